@@ -5,10 +5,18 @@
 #pragma once
 
 #include <stdint.h>
+#include <stddef.h>
 #include <tmos/system.h>
 #include <tmos/arch/ctrlreg.h>
 #include <tmos/arch/msr.h>
 
+// Number of CPUs we have per-CPU state for
+#ifndef __TMOS_CFG_SMP__
+#define __TMOS_CFG_NUM_CPUS__ 1
+#else
+#define __TMOS_CFG_NUM_CPUS__ __TMOS_CFG_MAX_NUM_CPUS__
+#endif
+
 // The CPU RFLAGS register
 union rflags {
 	uint64_t raw;
@@ -59,3 +67,37 @@ static inline void set_nx() {
 static inline void set_write_protect() {
 	write_cr0(read_cr0() | CR0_WRITE_PROTECT);
 }
+
+// Enable global pages, whose TLB entries are kept when CR3 is written
+static inline void set_global_pages() {
+	write_cr4(read_cr4() | CR4_PAGE_GLOB_ENABLE);
+}
+
+// Execute the CPUID instruction for the given leaf and subleaf
+static inline void cpuid(uint32_t leaf, uint32_t subleaf, uint32_t *a, uint32_t *b, uint32_t *c,
+                         uint32_t *d) {
+	__asm__ __volatile__ ("cpuid\n" : "=a"(*a), "=b"(*b), "=c"(*c), "=d"(*d)
+			      : "a"(leaf), "c"(subleaf) : );
+}
+
+// Local area of a CPU. The GS base of each CPU points to its own
+struct cpu_local {
+	uint32_t id; // Index of the CPU
+};
+
+// Set up the local area of the current CPU. Must be called on every CPU before it uses per-CPU
+// state
+void cpu_local_init();
+
+// Get the index of the current CPU, for indexing per-CPU state. On SMP, this is the initial APIC
+// ID, which we expect to be dense from 0. It is read from the CPU's local area
+static inline uint32_t cpu_get_id() {
+#ifndef __TMOS_CFG_SMP__
+	return 0;
+#else
+	uint32_t ret;
+	__asm__ __volatile__ ("mov %0, dword ptr gs:[%c1]" : "=r"(ret)
+			      : "i"(offsetof(struct cpu_local, id)) : );
+	return ret;
+#endif
+}
@@ -26,6 +26,11 @@
 #define CR3_PAGE_LEVEL_CACHE_DISABLE (1 << 4)
 #define CR3_PAGE_LEVEL_WRITE_THROUGH (1 << 3)
 
+// With CR4.PCIDE set, the low 12 bits of CR3 are the PCID, and setting bit 63 on a write keeps the
+// TLB entries tagged with the new PCID
+#define CR3_PCID_MASK    0xfff
+#define CR3_PCID_NOFLUSH ((uint64_t) 1 << 63)
+
 // Bits in CR4
 #define CR4_V8086_MODE_EXT      (1 << 0)
 #define CR4_PMODE_VIRT_INT      (1 << 1)
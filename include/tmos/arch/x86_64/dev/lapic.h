@@ -0,0 +1,16 @@
+// (C) 2018 Srimanta Barua
+// Interface for the local APIC
+
+#pragma once
+
+#include <stdint.h>
+
+// Enable the local APIC of this CPU, mapping its registers if required. Requires virtual memory to
+// be set up
+void lapic_init();
+
+// Send an inter-processor interrupt with the given vector to the CPU with the given APIC ID
+void lapic_send_ipi(uint32_t apic_id, uint8_t vector);
+
+// Send EOI for the interrupt being handled
+void lapic_send_eoi();
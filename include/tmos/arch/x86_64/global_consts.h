@@ -4,3 +4,6 @@
 
 // System default page size
 #define PAGE_SIZE   4096
+
+// Size of a cache line
+#define CACHE_LINE_SIZE 64
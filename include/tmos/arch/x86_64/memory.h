@@ -21,16 +21,23 @@
 #define PTE_PADDR_MASK         ((uint64_t) 0x000ffffffffff000)
 #define PTE_FLG_NO_EXEC        ((uint64_t) 0x8000000000000000)
 
-// Initialize virtual memory manager
-void vmm_init(struct pmmgr *pmmgr, void (*remap_cb) (void));
+// Fault-around window for vmm_map, passed along with the flags. When a page is first touched, the
+// untouched pages in the aligned window of 2^order pages around it are allocated too. Without this,
+// VMM_FAULT_AROUND_ORDER is used. Order 0 disables fault-around, and the maximum is 9
+#define PTE_FAULT_AROUND(order) ((uint64_t) ((order) + 1) << 52)
+#define PTE_FAULT_AROUND_MASK   ((uint64_t) 0xf << 52)
 
-// Allocate and map n virtual memory pages with the given flags
+// Initialize virtual memory manager, with a physmap of physical memory upto mem_end
+void vmm_init(struct pmmgr *pmmgr, void (*remap_cb) (void), paddr_t mem_end);
+
+// Allocate and map n virtual memory pages with the given flags. Kernel mappings are made global
 void vmm_map(vaddr_t addr, uint64_t n, uint64_t flags);
 
 // Free n virtual memory pages
 void vmm_free(vaddr_t vaddr, uint64_t n);
 
-// Map a virtual page to a given physical frame with the given flags
+// Map n virtual pages to n physical frames with the given flags. Uses 2M and 1G pages for ranges
+// where both addresses are suitably aligned
 void vmm_map_to(vaddr_t vaddr, paddr_t paddr, uint64_t n, uint64_t flags);
 
 // Translate a virtual address to a physical address
@@ -42,11 +49,76 @@ void vmm_unmap(vaddr_t vaddr, uint64_t n);
 // Print the page table structure
 void vmm_print_ptable();
 
+// Allocate a zeroed frame, from the pool of pre-zeroed frames if possible
+paddr_t vmm_alloc_zeroed();
+
+// Refill the pool of pre-zeroed frames by a batch. Meant to be called when idle
+void vmm_zero_idle();
+
+// Demand paging statistics
+struct vmm_fault_stats {
+	uint64_t faults; // Number of faults which allocated a page
+	uint64_t around; // Number of pages allocated around them, which would otherwise have faulted
+};
+
+// Get demand paging statistics
+void vmm_fault_stats(struct vmm_fault_stats *stats);
+
 // Switch address space to PML4 at given paddr, and return paddr of current PML4
 paddr_t vmm_switch_addr_space(paddr_t new_pml4_addr);
 
+// Forget the PCID of an address space. Must be called before its PML4 is freed
+void vmm_forget_addr_space(paddr_t pml4_addr);
+
+// Enter lazy TLB mode, promising not to touch user mappings, so that changes to them don't interrupt
+// this CPU. Meant for idle CPUs
+void vmm_lazy_enter();
+
+// Leave lazy TLB mode, flushing user mappings if they changed meanwhile
+void vmm_lazy_exit();
+
+// Handle the TLB shootdown requests queued for this CPU, without waiting for the IPI
+void vmm_shootdown_poll();
+
+#ifdef __TMOS_CFG_SMP__
+
+// TLB shootdown statistics
+struct vmm_shootdown_stats {
+	uint64_t requests;   // Number of shootdowns
+	uint64_t ipis;       // Number of IPIs sent
+	uint64_t lazy_skips; // Number of CPUs not interrupted since they were in lazy TLB mode
+};
+
+// Add this CPU to those taking part in TLB shootdowns. Called by each CPU once its local APIC is
+// enabled, and after page descriptors are set up
+void vmm_cpu_online();
+
+// Get TLB shootdown statistics
+void vmm_shootdown_stats(struct vmm_shootdown_stats *stats);
+
+#endif
+
 // Invalidate a page table entry
 void invlpg(vaddr_t addr);
 
 // Invalidate the whole TLP
 void tlb_flush_all();
+
+// Invalidate the whole TLB, including global entries of kernel mappings
+void tlb_flush_global();
+
+// Invalidate n pages starting at the given address
+void tlb_flush_range(vaddr_t addr, uint64_t n);
+
+// Get the address of physical memory in the physmap. Valid after vmm_init
+static inline void* phys_to_virt(paddr_t paddr) {
+	return (void*) (KRNL_PHYSMAP_START + paddr);
+}
+
+// Get the physical address for a virtual address. Addresses in the physmap don't need a page walk
+static inline paddr_t virt_to_phys(const void *vaddr) {
+	if ((vaddr_t) vaddr >= KRNL_PHYSMAP_START && (vaddr_t) vaddr < KRNL_PHYSMAP_END) {
+		return (vaddr_t) vaddr - KRNL_PHYSMAP_START;
+	}
+	return vmm_translate((vaddr_t) vaddr);
+}
@@ -6,7 +6,9 @@
 #include <tmos/system.h>
 
 // MSR numbers
-#define MSR_EFER 0xC0000080
+#define MSR_APIC_BASE 0x1B
+#define MSR_EFER      0xC0000080
+#define MSR_GS_BASE   0xC0000101
 
 
 // Bits in the EFER MSR
@@ -55,8 +55,17 @@ extern int __bss_end__;
 
 // From doc/memory_map_x86_64.txt
 #define KRNL_HEAP_START 0xffff800000000000
-#define KRNL_HEAP_SIZE  0x0000010000000000
+#define KRNL_HEAP_SIZE  0x0000008000000000
 #define KRNL_HEAP_END   (KRNL_HEAP_START + KRNL_HEAP_SIZE)
+#define KRNL_LHEAP_START 0xffff808000000000
+#define KRNL_LHEAP_SIZE  0x0000008000000000
+#define KRNL_LHEAP_END   (KRNL_LHEAP_START + KRNL_LHEAP_SIZE)
+#define KRNL_PAGES_START 0xffff810000000000
+#define KRNL_PAGES_SIZE  0x0000008000000000
+#define KRNL_PAGES_END   (KRNL_PAGES_START + KRNL_PAGES_SIZE)
+#define KRNL_PHYSMAP_START 0xffff880000000000
+#define KRNL_PHYSMAP_SIZE  0x0000400000000000
+#define KRNL_PHYSMAP_END   (KRNL_PHYSMAP_START + KRNL_PHYSMAP_SIZE)
 
 // Check if interrupts are enabled
 #define sys_int_enabled() (cpu_read_rflags().f.IF == 1)
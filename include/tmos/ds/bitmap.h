@@ -5,6 +5,7 @@
 #pragma once
 
 #include <tmos/system.h>
+#include <stdbool.h>
 
 // The bitmap structure
 struct bitmap {
@@ -39,3 +40,50 @@ struct bitmap {
 // Get size of bitmap in bytes
 #define BM_SZ(bm) \
 	((ROUND_UP((bm).num_bits, WORD_SIZE)) >> 3)
+
+// Find the index of the first set bit in a word. The word must not be 0
+#define __BM_WORD_FFS(w) ((word_t) __builtin_ctzll(w))
+
+// Find first bit in the bitmap at or after start whose value is `set`. Returns num_bits if there
+// is none
+static inline word_t __bm_find_first(const struct bitmap *bm, word_t start, bool set) {
+	word_t i, nw, w, bit;
+	if (start >= bm->num_bits) {
+		return bm->num_bits;
+	}
+	nw = ROUND_UP(bm->num_bits, WORD_SIZE) >> WORD_SIZE_SHIFT;
+	i = start >> WORD_SIZE_SHIFT;
+	w = (set ? bm->map[i] : ~bm->map[i]) & (WORD_MAX << (start & (WORD_SIZE - 1)));
+	while (!w) {
+		if (++i >= nw) {
+			return bm->num_bits;
+		}
+		w = set ? bm->map[i] : ~bm->map[i];
+	}
+	bit = (i << WORD_SIZE_SHIFT) + __BM_WORD_FFS(w);
+	return bit < bm->num_bits ? bit : bm->num_bits;
+}
+
+// Find first zero bit in the bitmap at or after start. Returns num_bits if there is none
+static inline word_t bm_find_first_zero(const struct bitmap *bm, word_t start) {
+	return __bm_find_first(bm, start, false);
+}
+
+// Find first set bit in the bitmap at or after start. Returns num_bits if there is none
+static inline word_t bm_find_first_set(const struct bitmap *bm, word_t start) {
+	return __bm_find_first(bm, start, true);
+}
+
+// Find the first run of n zero bits in the bitmap at or after start. Returns num_bits if there is
+// none
+static inline word_t bm_find_next_zero_range(const struct bitmap *bm, word_t start, word_t n) {
+	word_t end;
+	while ((start = bm_find_first_zero(bm, start)) < bm->num_bits) {
+		end = bm_find_first_set(bm, start);
+		if (end - start >= n) {
+			return start;
+		}
+		start = end;
+	}
+	return bm->num_bits;
+}
@@ -23,7 +23,7 @@ static inline void list_init(struct list *node) {
 // Add a list entry between two entries (internal)
 static inline void __list_add_between(struct list *node, struct list *prev, struct list *next) {
 	next->prev = node;
-	node->next =  prev;
+	node->next = next;
 	node->prev = prev;
 	prev->next = node;
 }
@@ -19,6 +19,8 @@
 
 #include <tmos/system.h>
 #include <stddef.h>
+#include <stdbool.h>
+#include <tmos/ds/list.h>
 
 // -------- MEMORY REGIONS --------
 
@@ -88,6 +90,9 @@ void mmap_insert_region(struct mmap *map, uint64_t start_addr, uint64_t end, uin
 // regions.
 void mmap_split_at(struct mmap *map, uint64_t addr);
 
+// Get the end of the highest available region in the memory map
+paddr_t mmap_get_avail_end(const struct mmap *map);
+
 // Print the memory map
 void mmap_print(const struct mmap *map);
 
@@ -116,7 +121,106 @@ struct pmmgr {
 };
 
 // Known physical memory managers
-extern struct pmmgr BM_SPL_PMMGR, BM_PMMGR;
+extern struct pmmgr BM_SPL_PMMGR, BM_PMMGR, BUDDY_PMMGR;
+
+// Per-CPU free frame caches in front of another physical memory manager (the backend). Single
+// frames are allocated and freed per-CPU, and moved to and from the backend in batches
+extern struct pmmgr PCPU_PMMGR;
+
+// Set the backend for PCPU_PMMGR. Must be called before it is initialized
+void pcpu_pmmgr_set_backend(struct pmmgr *backend);
+
+// -------- ZONES --------
+
+// Physical memory zones, by the devices which can address them
+#define ZONE_DMA    0 // Below 16M, for ISA DMA
+#define ZONE_DMA32  1 // Below 4G, for devices with 32-bit addressing
+#define ZONE_NORMAL 2 // Everything else
+#define NUM_ZONES   3
+
+// Limits of zones
+#define ZONE_DMA_END   ((paddr_t) 0x1000000)
+#define ZONE_DMA32_END ((paddr_t) 0x100000000)
+
+// Information about a zone
+struct zone_info {
+	paddr_t start, end; // Limits of the zone
+	uint64_t size;      // Number of frames of available memory in the zone, used or not
+};
+
+// Set up zones from the memory map, allocating from the given physical memory manager. It must
+// support special allocations
+void zone_init(const struct mmap *map, struct pmmgr *pmmgr);
+
+// Allocate num contiguous frames, aligned to (1 << align) frames, from the given zone. If the zone
+// is exhausted, fall back to lower zones. Returns PADDR_INVALID on failure
+paddr_t zone_alloc(uint32_t zone, uint32_t align, uint32_t num);
+
+// Free num contiguous frames allocated with zone_alloc
+void zone_free(paddr_t addr, uint32_t num);
+
+// Get the zone a physical address lies in
+uint32_t zone_of(paddr_t addr);
+
+// Get information about a zone. Returns false if there is no such zone
+bool zone_get_info(uint32_t zone, struct zone_info *info);
+
+// Print the zones
+void zone_print();
+
+// -------- PAGE DESCRIPTORS --------
+
+// Page flags
+#define PG_RESERVED   (1 << 0) // Not available RAM. Never allocated
+#define PG_LOCKED     (1 << 1) // Locked by its owner, eg. during I/O
+#define PG_DIRTY      (1 << 2) // Contents need to be written back
+#define PG_REFERENCED (1 << 3) // Recently used, for reclaim
+
+// Descriptor for a physical frame
+struct page {
+	struct list list;  // For use by whoever owns the frame, eg. free lists and LRU lists
+	uint32_t refcount; // Number of references to the frame
+	int32_t mapcount;  // Number of page table entries mapping the frame
+	uint32_t flags;
+	uint32_t private;  // For use by whoever owns the frame
+};
+
+// The page descriptor array, indexed by frame number, and the number of descriptors in it
+extern struct page *page_array;
+extern uint64_t page_array_num;
+
+// Initialize the page descriptor array from the memory map. Requires virtual memory to be set up
+void page_init(const struct mmap *map);
+
+// Get descriptor for a frame number
+static inline struct page* pfn_to_page(uint64_t pfn) {
+	return page_array + pfn;
+}
+
+// Get frame number for a descriptor
+static inline uint64_t page_to_pfn(const struct page *page) {
+	return page - page_array;
+}
+
+// Get descriptor for the frame containing a physical address
+static inline struct page* paddr_to_page(paddr_t addr) {
+	return pfn_to_page(addr >> PAGE_SIZE_SHIFT);
+}
+
+// Get physical address of the frame for a descriptor
+static inline paddr_t page_to_paddr(const struct page *page) {
+	return page_to_pfn(page) << PAGE_SIZE_SHIFT;
+}
+
+// Take a reference to a frame
+static inline void page_get(struct page *page) {
+	__atomic_add_fetch(&page->refcount, 1, __ATOMIC_RELAXED);
+}
+
+// Drop a reference to a frame. Returns true if it was the last one
+static inline bool page_put(struct page *page) {
+	return __atomic_sub_fetch(&page->refcount, 1, __ATOMIC_ACQ_REL) == 0;
+}
 
 // -------- KERNEL HEAP --------
 
@@ -126,6 +230,12 @@ void heap_init();
 // Allocate a block of memory of the given size
 void* kmalloc(size_t size);
 
+// Allocate a block of memory of the given size, aligned to the given power of 2 (upto PAGE_SIZE)
+void* kmalloc_aligned(size_t size, size_t align);
+
+// Allocate a block of memory of the given size, aligned to a cache line
+void* kmalloc_cacheline(size_t size);
+
 // Allocate a block of memory of the given size, and zero it out
 void* kcalloc(size_t nmemb, size_t size);
 
@@ -135,5 +245,97 @@ void* krealloc(void *ptr, size_t size);
 // Free allocated memory
 void kfree(void *ptr);
 
+// Allocate n pages of memory, aligned to a page boundary
+void* kmalloc_pages(uint64_t n);
+
+// Free memory allocated with kmalloc_pages
+void kfree_pages(void *ptr);
+
+#ifdef HEAP_DEBUG
+// Dump live allocations and allocation sites over klog
+void heap_dump_allocs();
+#endif
+
+// Heap fragmentation information. Fragmentation of free memory is 1 - (largest / free)
+struct heap_frag {
+	size_t free;    // Bytes in free chunks, not counting the top of the heap
+	size_t largest; // Bytes in the largest free chunk, not counting the top of the heap
+	size_t top;     // Bytes in the free chunk at the top of the heap
+};
+
+// Get heap fragmentation information
+void heap_get_frag(struct heap_frag *frag);
+
+// Allocation statistics for a heap size class
+struct heap_class_stats {
+	size_t size;     // Memory size of chunks in this class. 0 for large allocations
+	uint64_t allocs; // Number of allocations
+	uint64_t frees;  // Number of frees
+	uint64_t live;   // Number of live allocations
+	uint64_t hwm;    // High-water mark of live allocations
+};
+
+// Get allocation statistics for a size class. Classes are numbered from 0, and the last class is
+// for large allocations. Returns false if there is no such class
+bool heap_get_class_stats(size_t class, struct heap_class_stats *stats);
+
+// Get number of requests with size in (2^(bucket-1), 2^bucket]. The last bucket also counts all
+// larger requests
+uint64_t heap_get_hist(size_t bucket);
+
+// Dump heap statistics over klog
+void heap_dump_stats();
+
 // Increment/decrement the end of the kernel heap and return a pointer to the previous address
 void* ksbrk(intptr_t increment);
+
+// -------- ARENAS --------
+
+// A region of memory which is allocated from by bumping a pointer, and freed all at once. Arenas
+// are not locked, and are meant to have a single user
+struct arena;
+
+// Create an arena. The size is a hint for how much memory to set aside at a time
+struct arena* arena_create(size_t size);
+
+// Destroy an arena, freeing all memory allocated from it
+void arena_destroy(struct arena *arena);
+
+// Allocate memory of the given size from an arena
+void* arena_alloc(struct arena *arena, size_t size);
+
+// Free all memory allocated from an arena, keeping the arena itself
+void arena_reset(struct arena *arena);
+
+// -------- OBJECT CACHES --------
+
+// A cache of fixed-size objects
+struct kmem_cache;
+
+// Statistics for an object cache
+struct kmem_stats {
+	uint64_t allocs;   // Number of allocations
+	uint64_t frees;    // Number of frees
+	uint64_t active;   // Number of objects currently allocated
+	uint64_t slabs;    // Number of slabs currently held
+	uint64_t objsz;    // Size of an object including padding for alignment
+	uint64_t per_slab; // Number of objects in one slab
+};
+
+// Create a cache for objects of the given size and alignment (0 for word alignment). If given, the
+// constructor is called once on every object when its slab is created, and objects should be
+// returned to the cache in their constructed state. Objects must fit several to a page
+struct kmem_cache* kmem_cache_create(const char *name, size_t size, size_t align,
+                                     void (*ctor) (void*));
+
+// Destroy a cache. All objects must have been freed
+void kmem_cache_destroy(struct kmem_cache *cache);
+
+// Allocate an object from a cache
+void* kmem_cache_alloc(struct kmem_cache *cache);
+
+// Free an object to the cache it was allocated from
+void kmem_cache_free(struct kmem_cache *cache, void *obj);
+
+// Get statistics for a cache
+void kmem_cache_stats(struct kmem_cache *cache, struct kmem_stats *stats);
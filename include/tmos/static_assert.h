@@ -24,3 +24,6 @@
 
 // Check condition at compile-time
 #define STATIC_ASSERT(cond) STATIC_ASSERT_MSG(cond, "Assertion failed: " #cond)
+
+// Check condition at compile-time, at file scope
+#define STATIC_ASSERT_FILE(cond) _Static_assert(cond, "Assertion failed: " #cond)
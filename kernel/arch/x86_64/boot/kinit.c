@@ -13,7 +13,23 @@
 #include <tmos/arch/memory.h>
 #include <tmos/arch/idt.h>
 #include <tmos/arch/gdt.h>
+#include <tmos/arch/cpu.h>
 #include <tmos/arch/dev/pit.h>
+#include <tmos/arch/dev/lapic.h>
+
+// Frequency of the timer tick (Hz)
+#define KINIT_PIT_FREQ 100
+
+// Number of timer ticks each physical memory manager is benchmarked for, when built with KINIT_TESTS
+#ifndef KINIT_PMM_BENCH_TICKS
+#define KINIT_PMM_BENCH_TICKS 10
+#endif
+
+// Number of frames allocated before they are all freed again, in the benchmark
+#define KINIT_PMM_BENCH_BATCH 512
+
+// Order of the block of frames the bitmap manager is benchmarked on
+#define KINIT_PMM_BENCH_ORDER 10
 
 // Guard page (defined in entry.asm)
 extern int __guard_page__;
@@ -21,8 +37,17 @@ extern int __guard_page__;
 // The kernel's memory map
 static struct mmap _KMMAP = { 0 };
 
+// Arena for boot-time allocations which are never freed
+static struct arena *_boot_arena = NULL;
+
 // Function prototypes
 static void _init_mem_mngr();
+#ifdef KINIT_TESTS
+static void _run_tests();
+static void _check_huge_remap();
+static void _bench_pmm(const char *name, struct pmmgr *mgr);
+static void _bench_bm_pmmgr();
+#endif
 
 // -------- MULTIBOOT2 --------
 
@@ -88,7 +113,8 @@ void kinit_multiboot2(vaddr_t pointer) {
 	// Initialize and enable interrupts
 	gdt_init();
 	idt_init();
-	pit_start_counter(100);
+	cpu_local_init();
+	pit_start_counter(KINIT_PIT_FREQ);
 
 	// Load multiboot2 information table
 	if (mb2_table_load(pointer) < 0) {
@@ -106,6 +132,9 @@ void kinit_multiboot2(vaddr_t pointer) {
 
 	// Initialize memory management
 	_init_mem_mngr();
+#ifdef KINIT_TESTS
+	_run_tests();
+#endif
 
 	vmm_map(0x2000, 1, PTE_FLG_WRITABLE);
 	uint64_t *iptr = (uint64_t*) 0x2000;
@@ -113,12 +142,14 @@ void kinit_multiboot2(vaddr_t pointer) {
 
 	vmm_print_ptable();
 
-	// Kmalloc space for a string
+	// Allocate boot-time data
 	int i;
 	for (i = 0; i < 8; i++) {
-		klog("kmalloc #%d\n", i);
-		kmalloc(1000);
+		klog("arena_alloc #%d\n", i);
+		arena_alloc(_boot_arena, 1000);
 	}
+
+	// Kmalloc space for a string
 	char *str = kmalloc(1000);
 
 	// Write the string
@@ -128,8 +159,11 @@ void kinit_multiboot2(vaddr_t pointer) {
 	kfree(str);
 
 	sys_enable_int();
+	// The idle loop doesn't touch user mappings
+	vmm_lazy_enter();
 	while (1) {
 		klog("%lu\n", pit_get_ticks());
+		vmm_zero_idle();
 		__asm__ __volatile__ ("hlt;" : : : );
 	}
 
@@ -156,9 +190,106 @@ static void _init_mem_mngr() {
 			break;
 		}
 	}
-	BM_PMMGR.init(&_KMMAP.r[first], tot, 0x1000000, PADDR_ALGN_MASK);
+	pcpu_pmmgr_set_backend(&BUDDY_PMMGR);
+	// Single frames are never taken from ZONE_DMA. It is left for zone_alloc
+	PCPU_PMMGR.init(&_KMMAP.r[first], tot, ZONE_DMA_END, PADDR_ALGN_MASK);
+	zone_init(&_KMMAP, &PCPU_PMMGR);
+	zone_print();
 	// Initialize virtual memory manager
-	vmm_init(&BM_PMMGR, _remap_cb_multiboot2);
+	vmm_init(&PCPU_PMMGR, _remap_cb_multiboot2, mmap_get_avail_end(&_KMMAP));
+	// Set up page descriptors
+	page_init(&_KMMAP);
+#ifdef __TMOS_CFG_SMP__
+	// Enable the local APIC, and take part in TLB shootdowns
+	lapic_init();
+	vmm_cpu_online();
+#endif
 	// Initialize heap allocator
 	heap_init();
+	// Set up arena for boot-time allocations
+	_boot_arena = arena_create(PAGE_SIZE << 2);
+}
+
+#ifdef KINIT_TESTS
+
+// Run tests and benchmarks of memory management, once it is set up
+static void _run_tests() {
+	_check_huge_remap();
+	_bench_bm_pmmgr();
+	_bench_pmm("buddy", &BUDDY_PMMGR);
+	_bench_pmm("per-CPU buddy", &PCPU_PMMGR);
 }
+
+// Benchmark single-frame allocation with a physical memory manager on this CPU. Allocate a batch of
+// frames and free it again, for KINIT_PMM_BENCH_TICKS timer ticks, and log frames per second
+static void _bench_pmm(const char *name, struct pmmgr *mgr) {
+	static paddr_t frames[KINIT_PMM_BENCH_BATCH];
+	uint64_t start, now, n = 0;
+	uint32_t i;
+	bool intr;
+	// The timer only ticks with interrupts enabled. Start at a tick boundary
+	intr = sys_int_enabled();
+	sys_enable_int();
+	start = pit_get_ticks();
+	while ((now = pit_get_ticks()) == start) {
+		__asm__ __volatile__ ("pause;" : : : "memory");
+	}
+	start = now;
+	while (pit_get_ticks() - start < KINIT_PMM_BENCH_TICKS) {
+		for (i = 0; i < KINIT_PMM_BENCH_BATCH; i++) {
+			if ((frames[i] = mgr->alloc()) == PADDR_INVALID) {
+				break;
+			}
+		}
+		n += i;
+		while (i) {
+			mgr->free(frames[--i]);
+		}
+	}
+	now = pit_get_ticks();
+	if (!intr) {
+		sys_disable_int();
+	}
+	klog("PMM BENCH: %s: %llu frames/s\n", name, n * KINIT_PIT_FREQ / (now - start));
+}
+
+// Benchmark the bitmap manager. It is given a block of frames of its own by the manager in use,
+// and keeps its bitmap in the first frame of the block, which it reaches at KRNL_VBASE
+static void _bench_bm_pmmgr() {
+	paddr_t start, end, n = (paddr_t) 1 << KINIT_PMM_BENCH_ORDER;
+	region_t r[2];
+	// KRNL_VBASE is 2G below the top of the address space, so only the first 2G are reachable
+	start = PCPU_PMMGR.spl_alloc(ZONE_DMA_END, 0x80000000, 0, n);
+	if (start == PADDR_INVALID) {
+		klog("PMM BENCH: bitmap: no memory\n");
+		return;
+	}
+	end = start + (n << PAGE_SIZE_SHIFT);
+	vmm_map_to(start + KRNL_VBASE, start, 1, PTE_FLG_PRESENT | PTE_FLG_WRITABLE);
+	r[0] = REGION_NEW(end, REGION_TYPE_NONE);
+	r[1] = REGION_NEW(start, REGION_TYPE_AVAIL);
+	BM_PMMGR.init(r, 2, start, end);
+	_bench_pmm("bitmap", &BM_PMMGR);
+	vmm_unmap(start + KRNL_VBASE, 1);
+	PCPU_PMMGR.spl_free(start, n);
+}
+
+// Check that a 4K page can be remapped inside a 2M mapping. Unmapping it splits the huge page, and
+// the rest of the 2M stays mapped where it was
+static void _check_huge_remap() {
+	vaddr_t vaddr = 0x40000000, page = vaddr + (5 << PAGE_SIZE_SHIFT);
+	uint64_t span = PAGE_SIZE << 9;
+	vmm_map_to(vaddr, 0, span >> PAGE_SIZE_SHIFT, PTE_FLG_PRESENT);
+	ASSERT(vmm_translate(page) == 5 << PAGE_SIZE_SHIFT);
+	vmm_unmap(page, 1);
+	ASSERT(vmm_translate(page) == PADDR_INVALID);
+	vmm_map_to(page, span, 1, PTE_FLG_PRESENT);
+	ASSERT(vmm_translate(page) == span);
+	ASSERT(vmm_translate(page - PAGE_SIZE) == 4 << PAGE_SIZE_SHIFT);
+	ASSERT(vmm_translate(page + PAGE_SIZE) == 6 << PAGE_SIZE_SHIFT);
+	vmm_unmap(vaddr, span >> PAGE_SIZE_SHIFT);
+	ASSERT(vmm_translate(vaddr) == PADDR_INVALID);
+	klog("Remapped 4K page in 2M mapping\n");
+}
+
+#endif // KINIT_TESTS
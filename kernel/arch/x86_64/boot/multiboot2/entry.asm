@@ -142,17 +142,16 @@ gdtr64:
 ; Temporary page tables
 ; pml4[0]   -> pdp0
 ;     pdp0[0] -> 0 - 1 GB (Huge page)
-; pml4[510] -> pml4 (recursive mapping)
 ; pml4[511] -> pdp1
 ;     pdp1[510] -> 0 - 1 GB (Huge page)
 ;
-; This results in the first 2 MB of RAM being identity-mapped using one huge page, and also
-; mapped from a higher address (-2GB).
+; This results in the first 1 GB of RAM being identity-mapped using one huge page, and also
+; mapped from a higher address (-2GB). vmm_init reaches page tables through the latter until the
+; physmap is set up.
 align 4096
 pml4:
 	dq (pdp0 + 0x03)
-	times 509 dq 0
-	dq (pml4 + 0x03)
+	times 510 dq 0
 	dq (pdp1 + 0x03)
 pdp0:
 	dq 0x83
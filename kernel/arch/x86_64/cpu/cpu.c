@@ -2,10 +2,30 @@
 
 #include <tmos/arch/cpu.h>
 #include <tmos/arch/tss.h>
+#include <tmos/klog.h>
 
 // Buffer for holding TSS data
 char __tss_buf[__TMOS_CFG_MAX_NUM_TSS__ * __TMOS_CFG_BYTES_PER_TSS__] __attribute__ ((aligned(__TMOS_CFG_BYTES_PER_TSS__)));
 
+// Local areas of CPUs
+static struct cpu_local _cpu_local[__TMOS_CFG_NUM_CPUS__];
+
+// Set up the local area of the current CPU, and point the GS base to it. The index is looked up
+// with CPUID once here, so that cpu_get_id is a single load
+void cpu_local_init() {
+	uint32_t id = 0;
+#ifdef __TMOS_CFG_SMP__
+	uint32_t a, b, c, d;
+	cpuid(1, 0, &a, &b, &c, &d);
+	id = b >> 24;
+	if (id >= __TMOS_CFG_NUM_CPUS__) {
+		PANIC("CPU index %u out of range\n", id);
+	}
+#endif
+	_cpu_local[id].id = id;
+	wrmsr(MSR_GS_BASE, (uint64_t) &_cpu_local[id]);
+}
+
 // Stop forever
 void __attribute__((noreturn)) crash_and_burn() {
 	while (1) {
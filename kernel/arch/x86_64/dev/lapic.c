@@ -0,0 +1,77 @@
+// (C) 2018 Srimanta Barua
+// Code for enabling the local APIC, and sending inter-processor interrupts with it
+
+#include <tmos/arch/dev/lapic.h>
+#include <tmos/arch/memory.h>
+#include <tmos/arch/msr.h>
+#include <tmos/arch/idt.h>
+
+// Bits in the APIC base MSR
+#define MSR_APIC_BASE_ENABLE    (1 << 11)
+#define MSR_APIC_BASE_ADDR_MASK 0x000ffffffffff000
+
+// Register offsets
+#define LAPIC_REG_EOI    0x0b0
+#define LAPIC_REG_SVR    0x0f0
+#define LAPIC_REG_ICR_LO 0x300
+#define LAPIC_REG_ICR_HI 0x310
+
+// Bits in registers
+#define LAPIC_SVR_ENABLE    (1 << 8)
+#define LAPIC_ICR_PENDING   (1 << 12)
+#define LAPIC_ICR_ASSERT    (1 << 14)
+#define LAPIC_ICR_DEST_SHFT 24
+
+// Vector for spurious interrupts
+#define LAPIC_SPURIOUS_VECTOR 0xff
+
+// Registers, mapped uncached
+static volatile uint32_t *_regs = NULL;
+
+// Read a register
+static inline uint32_t _read(uint32_t reg) {
+	return _regs[reg >> 2];
+}
+
+// Write a register
+static inline void _write(uint32_t reg, uint32_t val) {
+	_regs[reg >> 2] = val;
+}
+
+// Spurious interrupts need no EOI
+static void __attribute__((naked)) _isr_spurious() {
+	__asm__ __volatile__ ("iretq;" : : : "memory");
+}
+
+// Enable the local APIC of this CPU, mapping its registers if required. Requires virtual memory to
+// be set up
+void lapic_init() {
+	paddr_t base;
+	vaddr_t vaddr;
+	base = rdmsr(MSR_APIC_BASE) & MSR_APIC_BASE_ADDR_MASK;
+	vaddr = (vaddr_t) phys_to_virt(base);
+	// The physmap only covers RAM, so the registers usually have to be mapped
+	if (!_regs && vmm_translate(vaddr) == PADDR_INVALID) {
+		vmm_map_to(vaddr, base, 1, PTE_FLG_PRESENT | PTE_FLG_WRITABLE | PTE_FLG_NO_CACHE
+			   | PTE_FLG_NO_EXEC);
+	}
+	_regs = (volatile uint32_t*) vaddr;
+	wrmsr(MSR_APIC_BASE, rdmsr(MSR_APIC_BASE) | MSR_APIC_BASE_ENABLE);
+	isr_set_gate(LAPIC_SPURIOUS_VECTOR, _isr_spurious, 0, 0x08, IDT_ATTR_PRESENT | IDT_ATTR_INT_32);
+	_write(LAPIC_REG_SVR, (_read(LAPIC_REG_SVR) & ~0xff) | LAPIC_SVR_ENABLE | LAPIC_SPURIOUS_VECTOR);
+}
+
+// Send an inter-processor interrupt with the given vector to the CPU with the given APIC ID. Must be
+// called with interrupts disabled, since the command is written in two parts
+void lapic_send_ipi(uint32_t apic_id, uint8_t vector) {
+	while (_read(LAPIC_REG_ICR_LO) & LAPIC_ICR_PENDING) {
+		__asm__ __volatile__ ("pause" : : : "memory");
+	}
+	_write(LAPIC_REG_ICR_HI, apic_id << LAPIC_ICR_DEST_SHFT);
+	_write(LAPIC_REG_ICR_LO, LAPIC_ICR_ASSERT | vector);
+}
+
+// Send EOI for the interrupt being handled
+void lapic_send_eoi() {
+	_write(LAPIC_REG_EOI, 0);
+}
@@ -6,18 +6,59 @@
 #include <stdbool.h>
 #include <string.h>
 #include <tmos/klog.h>
+#include <tmos/spin.h>
 #include <tmos/arch/memory.h>
 #include <tmos/arch/cpu.h>
 #include <tmos/arch/idt.h>
+#include <tmos/arch/dev/lapic.h>
 
 // A page table
 struct ptable {
 	uint64_t e[512];
 };
 
-// Virtual addr for PML4
-#define PML4_VADDR 0xffffff7fbfdfe000
-#define TEMP_VADDR 0xffffff8000000000
+// Physical memory the boot page tables map at KRNL_VBASE
+#define BOOT_MAPPED_END 0x40000000
+
+// CPUID 0x80000001 EDX bit for 1G page support
+#define CPUID_EXT_EDX_PDPE1GB (1 << 26)
+
+// CPUID 1 ECX bit for PCID support
+#define CPUID_ECX_PCID (1 << 17)
+
+// Number of address spaces per CPU which keep their TLB entries across switches. Must be less than
+// 4096, the number of PCIDs
+#ifndef VMM_NUM_PCIDS
+#define VMM_NUM_PCIDS 16
+#endif
+
+// Maximum number of frames in the pool of pre-zeroed frames
+#ifndef VMM_ZPOOL_SIZE
+#define VMM_ZPOOL_SIZE 64
+#endif
+
+// Number of frames zeroed in one go when idle
+#ifndef VMM_ZPOOL_BATCH
+#define VMM_ZPOOL_BATCH 8
+#endif
+
+// Number of pages beyond which a ranged TLB flush flushes everything
+#ifndef VMM_FLUSH_ALL_THRESHOLD
+#define VMM_FLUSH_ALL_THRESHOLD 32
+#endif
+
+// Order of the default fault-around window, in pages, for mappings which don't specify one
+#ifndef VMM_FAULT_AROUND_ORDER
+#define VMM_FAULT_AROUND_ORDER 4
+#endif
+#if VMM_FAULT_AROUND_ORDER > 9
+#error "Fault-around window can't be larger than a page table"
+#endif
+
+// Number of runs of frames a TLB gather holds before it has to flush
+#ifndef VMM_GATHER_SIZE
+#define VMM_GATHER_SIZE 32
+#endif
 
 // Check and set unused
 #define PTE_UNUSED(e) ((e) == 0)
@@ -38,6 +79,14 @@ struct ptable {
 // Get all flags
 #define PTE_FLAGS(e) ((e) & ~PTE_PADDR_MASK)
 
+// The number of used entries in a table is kept in the ignored bits 52-61 of the entry pointing to
+// it, so that we know when the table becomes empty without scanning it
+#define PTE_CNT_SHIFT 52
+#define PTE_CNT_MASK  ((uint64_t) 0x3ff << PTE_CNT_SHIFT)
+#define PTE_CNT(e)    (((e) & PTE_CNT_MASK) >> PTE_CNT_SHIFT)
+#define PTE_CNT_ADD(e,n) do { e += (uint64_t) (n) << PTE_CNT_SHIFT; } while (0)
+#define PTE_CNT_SUB(e,n) do { e -= (uint64_t) (n) << PTE_CNT_SHIFT; } while (0)
+
 // Set and unset flag
 #define PTE_SET_FLG(e,flag)   do { e |= flag; } while (0)
 #define PTE_UNSET_FLG(e,flag) do { e &= ~(flag); } while (0)
@@ -52,6 +101,12 @@ struct ptable {
 	e = (addr) | (flags);          \
 } while (0);
 
+// Number of entries in a page table, and the address range covered by a PT, PD and PDP
+#define PT_NUM_ENTRIES 512
+#define PT_SPAN        ((vaddr_t) PAGE_SIZE << 9)
+#define PD_SPAN        (PT_SPAN << 9)
+#define PDP_SPAN       (PD_SPAN << 9)
+
 // Get table index for given address
 #define PML4_IDX(addr) (((vaddr_t) (addr) >> 39) & 0x1ff)
 #define PDP_IDX(addr) (((vaddr_t) (addr) >> 30) & 0x1ff)
@@ -62,9 +117,8 @@ struct ptable {
 #define VADDR_IS_VALID(addr) \
 	(((addr) & 0xfff8000000000000) == 0 || ((addr) & 0xfff8000000000000) == 0xfff8000000000000)
 
-// Get address of child table at given index, given address of parent
-#define PT_CHILD(parent, idx) \
-	((struct ptable*) ((((vaddr_t) (parent) << 9) | 0xffff000000000000) | ((idx) << 12)))
+// Check if a virtual address is in the kernel half
+#define VADDR_IS_KERNEL(addr) (((addr) & 0xffff800000000000) == 0xffff800000000000)
 
 // The underlying physical memory manager
 static struct pmmgr *_PMMGR = NULL;
@@ -72,147 +126,647 @@ static struct pmmgr *_PMMGR = NULL;
 // Pointer to the current end of the kernel heap
 static void *_brkptr = (void*) KRNL_HEAP_START;
 
+// Base of the mapping through which we reach physical memory, and thus page tables. Until the
+// physmap is set up, this is the boot mapping of the first 1G at KRNL_VBASE
+static vaddr_t _physbase = 0;
+
+// End of physical memory to map in the physmap
+static paddr_t _physmap_end = 0;
+
+// PML4 each CPU targets with mapping operations instead of the current one, or 0. Set by
+// _do_with_pml4
+static paddr_t _target[__TMOS_CFG_NUM_CPUS__];
+
+// Whether the CPU supports 1G pages
+static bool _gb_pages = false;
+
+// Address spaces recently switched to on a CPU. The one in slot i is tagged with PCID i + 1, and
+// PCID 0 is left for the boot address space. A PML4 address of 0 marks a free slot
+struct pcid_cache {
+	paddr_t pml4[VMM_NUM_PCIDS];
+	uint32_t next; // Slot to recycle next
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+static struct pcid_cache _pcid[__TMOS_CFG_NUM_CPUS__];
+
+// Whether PCIDs are enabled
+static bool _pcid_enabled = false;
+
+#ifdef __TMOS_CFG_SMP__
+
+// Vector of the TLB shootdown IPI
+#ifndef VMM_SHOOTDOWN_VECTOR
+#define VMM_SHOOTDOWN_VECTOR 0xfd
+#endif
+
+// A request to invalidate [start, end) in the address space with the given PML4, or in kernel
+// mappings if pml4 is 0. It lives on the sender's stack until pending, the number of CPUs yet to
+// handle it, drops to 0
+struct shootdown {
+	paddr_t pml4;
+	vaddr_t start, end;
+	uint32_t pending;
+};
+
+// A link in a CPU's queue of shootdown requests
+struct shootdown_link {
+	struct shootdown_link *next;
+	struct shootdown *req;
+};
+
+// TLB state of a CPU
+struct cpu_tlb {
+	struct shootdown_link *queue; // Lock-free stack of requests, pushed by senders
+	paddr_t pml4;                 // Loaded PML4
+	bool lazy;                    // Not touching user mappings, so their flushes can wait
+	bool stale;                   // User mappings may have changed since entering lazy mode
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+static struct cpu_tlb _cpu_tlb[__TMOS_CFG_NUM_CPUS__];
+
+// CPUs which take part in shootdowns
+static uint32_t _cpus_online = 0;
+
+// Shootdown statistics, for measuring their cost. Not exact, since they are updated without locks
+static struct vmm_shootdown_stats _shootdown_stats = { 0 };
+
+#endif // __TMOS_CFG_SMP__
+
+// A batch of TLB invalidations. The unmapped range is collected, and frames which were mapped in it
+// or held its page tables are only freed once the TLB has been flushed, so that they can't be
+// reached through stale entries after being reused. Frames are kept as runs of contiguous frames
+struct tlb_gather {
+	vaddr_t start, end; // Range to flush. Empty if start >= end
+	paddr_t frames[VMM_GATHER_SIZE];
+	uint64_t num[VMM_GATHER_SIZE];
+	uint32_t nruns;
+	bool tables;        // Whether page tables are among the frames
+};
+
+// Pool of pre-zeroed frames
+static struct {
+	paddr_t frames[VMM_ZPOOL_SIZE];
+	uint32_t num;
+	spin_t lock;
+} _zpool = { .num = 0, .lock = SPIN_UNLOCKED };
+
+// Get the virtual address through which a physical address can be reached
+static inline void* _phys(paddr_t paddr) {
+	return (void*) (_physbase + paddr);
+}
+
+// Get the PML4 of the address space loaded on this CPU
+static inline struct ptable* _cur_pml4() {
+	return (struct ptable*) _phys(read_cr3() & CR3_PML4_PADDR_MASK);
+}
+
+// Get the paddr of the PML4 targeted by mapping operations on this CPU
+static inline paddr_t _target_pml4() {
+	paddr_t ret = _target[cpu_get_id()];
+	return ret ? ret : read_cr3() & CR3_PML4_PADDR_MASK;
+}
+
+// Zero out a page with string stores
+static inline void _zero_page(void *ptr) {
+	uint64_t cnt = PAGE_SIZE >> 3;
+	__asm__ __volatile__ ("rep stosq;" : "+D"(ptr), "+c"(cnt) : "a"(0) : "memory");
+}
+
+// Take a frame from the pool of pre-zeroed frames, or return PADDR_INVALID if empty
+static paddr_t _zpool_take() {
+	paddr_t ret = PADDR_INVALID;
+	spin_lock_intsafe(&_zpool.lock);
+	if (_zpool.num) {
+		ret = _zpool.frames[--_zpool.num];
+	}
+	spin_unlock(&_zpool.lock);
+	return ret;
+}
+
+// Allocate a zeroed frame for a page table. Prefer a pre-zeroed frame
+static paddr_t _pt_alloc() {
+	paddr_t paddr;
+	if ((paddr = _zpool_take()) != PADDR_INVALID) {
+		return paddr;
+	}
+	// Until the physmap is up, we can only reach what the boot page tables map. Single frames may
+	// come from anywhere, so ask for one below that if the pmmgr lets us
+	if (_physbase != KRNL_PHYSMAP_START && _PMMGR->spl_alloc) {
+		paddr = _PMMGR->spl_alloc(ZONE_DMA_END, BOOT_MAPPED_END, 0, 1);
+	} else {
+		paddr = _PMMGR->alloc();
+	}
+	ASSERT(paddr != PADDR_INVALID);
+	ASSERT(_physbase == KRNL_PHYSMAP_START || paddr < BOOT_MAPPED_END);
+	_zero_page(_phys(paddr));
+	return paddr;
+}
+
 // Returns the child table. If not present, or huge, return NULL
 static struct ptable* _pt_child(const struct ptable *tab, uint64_t idx) {
 	if (PTE_PRESENT(tab->e[idx]) &&  !PTE_HUGE(tab->e[idx])) {
-		return (struct ptable*) PT_CHILD(tab, idx);
+		return (struct ptable*) _phys(PTE_PADDR(tab->e[idx]));
 	}
 	return NULL;
 }
 
-// Check if a table exists. If yes, return. Else create and return
-static struct ptable* _pt_create(struct ptable *tab, uint64_t idx) {
+// Check if a table exists. If yes, return. Else create and return. ref is the entry pointing to tab,
+// which keeps its count of used entries, or NULL if tab is a PML4
+static struct ptable* _pt_create(struct ptable *tab, uint64_t idx, uint64_t *ref) {
 	paddr_t paddr;
-	struct ptable *ptr;
 	if (PTE_PRESENT(tab->e[idx])) {
 		if (!PTE_HUGE(tab->e[idx])) {
-			return PT_CHILD(tab, idx);
+			return (struct ptable*) _phys(PTE_PADDR(tab->e[idx]));
 		}
 		return NULL;
 	}
 	// Not present, create
-	ASSERT((paddr = _PMMGR->alloc()) != PADDR_INVALID);
-	tab->e[idx] = 0;
+	paddr = _pt_alloc();
 	PTE_SET(tab->e[idx], paddr, PTE_FLG_PRESENT | PTE_FLG_WRITABLE);
-	// Zero out the entry and return
-	ptr = (struct ptable*) PT_CHILD(tab, idx);
-	memset(ptr, 0, PAGE_SIZE);
-	return ptr;
+	if (ref) {
+		PTE_CNT_ADD(*ref, 1);
+	}
+	return (struct ptable*) _phys(paddr);
+}
+
+// Get the value to load into CR3 to switch to the given PML4. If the PML4 still has a PCID on this
+// CPU, its TLB entries are kept. Otherwise the PCID in the next slot is recycled, and the entries
+// tagged with it are flushed. The PML4 which had the slot, if any, is returned in evicted. Called
+// with interrupts disabled
+static uint64_t _pcid_cr3(paddr_t pml4_frame, paddr_t *evicted) {
+	struct pcid_cache *cache = &_pcid[cpu_get_id()];
+	uint32_t i;
+	*evicted = 0;
+	for (i = 0; i < VMM_NUM_PCIDS; i++) {
+		if (cache->pml4[i] == pml4_frame) {
+			return pml4_frame | (i + 1) | CR3_PCID_NOFLUSH;
+		}
+	}
+	i = cache->next;
+	cache->next = (i + 1) % VMM_NUM_PCIDS;
+	*evicted = cache->pml4[i];
+	cache->pml4[i] = pml4_frame;
+	return pml4_frame | (i + 1);
+}
+
+// Drop the PCID of the given PML4 on this CPU. A CPU's slots are only touched by itself, so this is
+// called with interrupts disabled
+static void _pcid_forget_local(paddr_t pml4_frame) {
+	struct pcid_cache *cache = &_pcid[cpu_get_id()];
+	uint32_t i;
+	for (i = 0; i < VMM_NUM_PCIDS; i++) {
+		if (cache->pml4[i] == pml4_frame) {
+			cache->pml4[i] = 0;
+		}
+	}
+}
+
+
+#ifdef __TMOS_CFG_SMP__
+
+// CPU masks are 32 bits wide
+#if __TMOS_CFG_NUM_CPUS__ > 32
+#error "TLB shootdown supports atmost 32 CPUs"
+#endif
+
+// Get the mask of CPUs which may have TLB entries for the address space with the given PML4. It is
+// kept in the private field of the PML4's page descriptor. Before page descriptors are set up, only
+// the boot CPU runs, and NULL is returned
+static inline uint32_t* _as_cpus(paddr_t pml4_frame) {
+	if (!page_array) {
+		return NULL;
+	}
+	return &paddr_to_page(pml4_frame)->private;
 }
 
-// Internal free function to reduce code
+// Note that this CPU is switching from PML4 old to new. evicted is a PML4 whose entries this CPU has
+// dropped, or 0. Called with interrupts disabled, before new is loaded
+static void _tlb_cpu_switch(paddr_t old, paddr_t new, paddr_t evicted) {
+	uint32_t cpu = cpu_get_id(), *mask;
+	if ((mask = _as_cpus(new))) {
+		__atomic_or_fetch(mask, 1 << cpu, __ATOMIC_SEQ_CST);
+	}
+	// Without PCIDs, nothing of the old address space survives the switch
+	if (!_pcid_enabled) {
+		evicted = old;
+	}
+	if (evicted && evicted != new && (mask = _as_cpus(evicted))) {
+		__atomic_and_fetch(mask, ~(1 << cpu), __ATOMIC_SEQ_CST);
+	}
+	__atomic_store_n(&_cpu_tlb[cpu].pml4, new, __ATOMIC_SEQ_CST);
+}
+
+// Handle the shootdown requests queued for this CPU. Called with interrupts disabled
+static void _shootdown_handle() {
+	struct cpu_tlb *state = &_cpu_tlb[cpu_get_id()];
+	struct shootdown_link *link, *next;
+	struct shootdown *req;
+	uint32_t *mask;
+	link = __atomic_exchange_n(&state->queue, NULL, __ATOMIC_ACQUIRE);
+	for (; link; link = next) {
+		// The link lives on the sender's stack, which may be gone once the request is acknowledged
+		next = link->next;
+		req = link->req;
+		if (!req->pml4 || req->pml4 == (read_cr3() & CR3_PML4_PADDR_MASK)) {
+			tlb_flush_range(req->start, (req->end - req->start) >> PAGE_SIZE_SHIFT);
+		} else if (_pcid_enabled) {
+			// The address space is not loaded. Its entries only survive with its PCID
+			_pcid_forget_local(req->pml4);
+			if ((mask = _as_cpus(req->pml4))) {
+				__atomic_and_fetch(mask, ~(1 << cpu_get_id()), __ATOMIC_SEQ_CST);
+			}
+		}
+		__atomic_sub_fetch(&req->pending, 1, __ATOMIC_RELEASE);
+	}
+}
+
+// Invalidate [start, end) on all other CPUs which may have it cached, and wait until they are done.
+// pml4 is the address space the range is in, or 0 for kernel mappings, which all CPUs share. Callers
+// may hold spinlocks, so CPUs waiting for a lock handle requests while they spin. CPUs in lazy TLB
+// mode are not interrupted for user mappings, but flush when they leave it. That is not enough if
+// page tables are being freed, since the CPU may still walk them speculatively, so then they are
+// interrupted too
+static void _shootdown(paddr_t pml4, vaddr_t start, vaddr_t end, bool tables) {
+	struct shootdown req = { .pml4 = pml4, .start = start, .end = end, .pending = 0 };
+	struct shootdown_link links[__TMOS_CFG_NUM_CPUS__];
+	struct cpu_tlb *state;
+	uint32_t self, targets, *mask, i;
+	bool intr;
+	intr = sys_int_enabled();
+	sys_disable_int();
+	self = cpu_get_id();
+	targets = __atomic_load_n(&_cpus_online, __ATOMIC_SEQ_CST) & ~(1 << self);
+	if (pml4 && (mask = _as_cpus(pml4))) {
+		targets &= __atomic_load_n(mask, __ATOMIC_SEQ_CST);
+	}
+	for (i = 0; targets; i++, targets >>= 1) {
+		if (!(targets & 1)) {
+			continue;
+		}
+		state = &_cpu_tlb[i];
+		if (pml4 && !tables && __atomic_load_n(&state->lazy, __ATOMIC_SEQ_CST)
+		    && __atomic_load_n(&state->pml4, __ATOMIC_SEQ_CST) == pml4) {
+			// Mark stale before checking for lazy mode again, while vmm_lazy_exit does the
+			// opposite, so that atleast one of us notices the other
+			__atomic_store_n(&state->stale, true, __ATOMIC_SEQ_CST);
+			if (__atomic_load_n(&state->lazy, __ATOMIC_SEQ_CST)) {
+				_shootdown_stats.lazy_skips++;
+				continue;
+			}
+		}
+		links[i].req = &req;
+		__atomic_add_fetch(&req.pending, 1, __ATOMIC_SEQ_CST);
+		links[i].next = __atomic_load_n(&state->queue, __ATOMIC_RELAXED);
+		while (!__atomic_compare_exchange_n(&state->queue, &links[i].next, &links[i], true,
+						    __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+		lapic_send_ipi(i, VMM_SHOOTDOWN_VECTOR);
+		_shootdown_stats.ipis++;
+	}
+	// Handle requests sent to us meanwhile, so that two CPUs shooting at each other don't deadlock
+	while (__atomic_load_n(&req.pending, __ATOMIC_ACQUIRE)) {
+		_shootdown_handle();
+		__asm__ __volatile__ ("pause" : : : "memory");
+	}
+	_shootdown_stats.requests++;
+	if (intr) {
+		sys_enable_int();
+	}
+}
+
+// Shootdown IPI handler
+static void __attribute__((naked)) _isr_shootdown() {
+	ISR_PUSH_REGS;
+	__asm__ __volatile__ ("call vmm_shootdown_handler;" : : : "memory");
+	ISR_POP_REGS;
+	__asm__ __volatile__ ("iretq;" : : : "memory");
+}
+
+#else
+
+// Without SMP, there are no other CPUs to keep track of or to shoot down
+
+static inline void _tlb_cpu_switch(paddr_t old, paddr_t new, paddr_t evicted) {
+	(void) old;
+	(void) new;
+	(void) evicted;
+}
+
+static inline void _shootdown(paddr_t pml4, vaddr_t start, vaddr_t end, bool tables) {
+	(void) pml4;
+	(void) start;
+	(void) end;
+	(void) tables;
+}
+
+#endif // __TMOS_CFG_SMP__
+
+// Drop the PCID of the given PML4 on all CPUs, so that switching to it next flushes stale entries.
+// Other CPUs are sent an empty shootdown, which makes those which don't have it loaded drop theirs
+static void _pcid_forget(paddr_t pml4_frame) {
+	bool intr;
+	intr = sys_int_enabled();
+	sys_disable_int();
+	_pcid_forget_local(pml4_frame);
+	if (intr) {
+		sys_enable_int();
+	}
+	_shootdown(pml4_frame, 0, 0, false);
+}
+
+// Start an empty TLB gather
+static void _tlb_gather_init(struct tlb_gather *tlb) {
+	tlb->start = ~(vaddr_t) 0;
+	tlb->end = 0;
+	tlb->nruns = 0;
+	tlb->tables = false;
+}
+
+// Add n pages starting at vaddr to the range to flush
+static void _tlb_gather_range(struct tlb_gather *tlb, vaddr_t vaddr, uint64_t n) {
+	if (vaddr < tlb->start) {
+		tlb->start = vaddr;
+	}
+	if (vaddr + (n << PAGE_SIZE_SHIFT) > tlb->end) {
+		tlb->end = vaddr + (n << PAGE_SIZE_SHIFT);
+	}
+}
+
+// Flush the collected range in one go, and then free the collected frames
+static void _tlb_gather_flush(struct tlb_gather *tlb) {
+	paddr_t paddr, end;
+	uint32_t i;
+	if (tlb->start < tlb->end) {
+		tlb_flush_range(tlb->start, (tlb->end - tlb->start) >> PAGE_SIZE_SHIFT);
+		_shootdown(VADDR_IS_KERNEL(tlb->start) ? 0 : _target_pml4(), tlb->start, tlb->end,
+			   tlb->tables);
+	}
+	for (i = 0; i < tlb->nruns; i++) {
+		end = tlb->frames[i] + (tlb->num[i] << PAGE_SIZE_SHIFT);
+		for (paddr = tlb->frames[i]; paddr < end; paddr += PAGE_SIZE) {
+			_PMMGR->free(paddr);
+		}
+	}
+	_tlb_gather_init(tlb);
+}
+
+// Free n contiguous frames starting at paddr after the flush. Their mappings must already have been
+// cleared and added to the range, since a full gather is flushed here
+static void _tlb_gather_frames(struct tlb_gather *tlb, paddr_t paddr, uint64_t n) {
+	uint32_t last = tlb->nruns - 1;
+	if (tlb->nruns && tlb->frames[last] + (tlb->num[last] << PAGE_SIZE_SHIFT) == paddr) {
+		tlb->num[last] += n;
+		return;
+	}
+	if (tlb->nruns == VMM_GATHER_SIZE) {
+		_tlb_gather_flush(tlb);
+	}
+	tlb->frames[tlb->nruns] = paddr;
+	tlb->num[tlb->nruns++] = n;
+}
+
+// Free the child table at the given index of a table, once the TLB has been flushed. vaddr is an
+// address the table maps, whose invalidation also drops cached references to the table
+static void _pt_free(struct ptable *tab, uint64_t idx, vaddr_t vaddr, struct tlb_gather *tlb) {
+	paddr_t paddr = PTE_PADDR(tab->e[idx]);
+	tab->e[idx] = 0;
+	tlb->tables = true;
+	_tlb_gather_range(tlb, vaddr, 1);
+	_tlb_gather_frames(tlb, paddr, 1);
+}
+
+// Split the huge page at the given index of a table into a table of smaller pages mapping the same
+// memory. span is the size of the huge page, and vaddr an address within it
+static void _pt_split(struct ptable *tab, uint64_t idx, vaddr_t span, vaddr_t vaddr) {
+	struct ptable *child;
+	paddr_t paddr, base;
+	uint64_t flags, i, step = span >> 9;
+	ASSERT(PTE_PRESENT(tab->e[idx]) && PTE_HUGE(tab->e[idx]));
+	base = PTE_PADDR(tab->e[idx]) & ~(span - 1);
+	flags = PTE_FLAGS(tab->e[idx]);
+	if (step == PAGE_SIZE) {
+		flags &= ~PTE_FLG_HUGE_PAGE;
+	}
+	paddr = _pt_alloc();
+	child = (struct ptable*) _phys(paddr);
+	for (i = 0; i < PT_NUM_ENTRIES; i++) {
+		PTE_SET(child->e[i], base + i * step, flags);
+	}
+	PTE_SET(tab->e[idx], paddr, PTE_FLG_PRESENT | PTE_FLG_WRITABLE | (flags & PTE_FLG_USER_ACCESS));
+	PTE_CNT_ADD(tab->e[idx], PT_NUM_ENTRIES);
+	invlpg(vaddr);
+}
+
+// Clear a huge page entry, freeing its frames after the flush if required
+static void _huge_clear(uint64_t *entry, vaddr_t span, bool do_free, struct tlb_gather *tlb) {
+	paddr_t paddr = PTE_PADDR(*entry) & ~(span - 1);
+	*entry = 0;
+	if (do_free) {
+		_tlb_gather_frames(tlb, paddr, span >> PAGE_SIZE_SHIFT);
+	}
+}
+
+// Internal map function to reduce code. Fills the entries in one page table at a time, and only
+// walks down from the level whose boundary was crossed. If paddr is PADDR_INVALID, entries are
+// marked to be allocated on access. Otherwise, the largest pages that alignment allows are used.
+// The range must not overlap existing mappings. Unmap first to replace part of a huge page
+static void _do_map(vaddr_t vaddr, paddr_t paddr, uint64_t n, uint64_t flags) {
+	struct ptable *pml4, *pdp = NULL, *pd = NULL, *pt;
+	uint64_t i4, i3, i2, idx, i, cnt;
+	bool huge = paddr != PADDR_INVALID;
+	// Check we're initialized
+	ASSERT(_PMMGR);
+	// Check if addresses are valid
+	ASSERT(vaddr);
+	ASSERT(VADDR_IS_VALID(vaddr));
+	ASSERT(!(vaddr & 0xfff));
+	ASSERT(paddr == PADDR_INVALID || !(paddr & ~PADDR_ALGN_MASK));
+	// Kernel mappings are the same in every address space, so keep them in the TLB across switches
+	if (VADDR_IS_KERNEL(vaddr) && !(flags & PTE_FLG_USER_ACCESS)) {
+		flags |= PTE_FLG_GLOBAL;
+	}
+	// If tables are not present, create then. If couldn't create, panic
+	pml4 = (struct ptable*) _phys(_target_pml4());
+	while (n) {
+		i4 = PML4_IDX(vaddr);
+		i3 = PDP_IDX(vaddr);
+		i2 = PD_IDX(vaddr);
+		if (!pdp || IS_ALIGNED(vaddr, PDP_SPAN)) {
+			ASSERT(pdp = _pt_create(pml4, i4, NULL));
+		}
+		// Map a 1G page if we can
+		if (huge && _gb_pages && IS_ALIGNED(vaddr | paddr, PD_SPAN) && n >= (PD_SPAN >> PAGE_SIZE_SHIFT)) {
+			ASSERT(PTE_UNUSED(pdp->e[i3]));
+			PTE_SET(pdp->e[i3], paddr, flags | PTE_FLG_PRESENT | PTE_FLG_HUGE_PAGE);
+			PTE_CNT_ADD(pml4->e[i4], 1);
+			cnt = PD_SPAN >> PAGE_SIZE_SHIFT;
+			pd = NULL;
+			goto next;
+		}
+		if (!pd || IS_ALIGNED(vaddr, PD_SPAN)) {
+			if (PTE_HUGE(pdp->e[i3])) {
+				PANIC("Mapping over huge page at %#llx\n", vaddr);
+			}
+			ASSERT(pd = _pt_create(pdp, i3, &pml4->e[i4]));
+		}
+		// Map a 2M page if we can
+		if (huge && IS_ALIGNED(vaddr | paddr, PT_SPAN) && n >= (PT_SPAN >> PAGE_SIZE_SHIFT)) {
+			ASSERT(PTE_UNUSED(pd->e[i2]));
+			PTE_SET(pd->e[i2], paddr, flags | PTE_FLG_PRESENT | PTE_FLG_HUGE_PAGE);
+			PTE_CNT_ADD(pdp->e[i3], 1);
+			cnt = PT_SPAN >> PAGE_SIZE_SHIFT;
+			goto next;
+		}
+		if (PTE_HUGE(pd->e[i2])) {
+			PANIC("Mapping over huge page at %#llx\n", vaddr);
+		}
+		ASSERT(pt = _pt_create(pd, i2, &pdp->e[i3]));
+		// Fill the run of entries in this table
+		idx = PT_IDX(vaddr);
+		cnt = PT_NUM_ENTRIES - idx < n ? PT_NUM_ENTRIES - idx : n;
+		for (i = idx; i < idx + cnt; i++) {
+			// Check that PT entry is unused
+			ASSERT(PTE_UNUSED(pt->e[i]));
+			if (huge) {
+				PTE_SET(pt->e[i], paddr + ((i - idx) << PAGE_SIZE_SHIFT), flags | PTE_FLG_PRESENT);
+			} else {
+				PTE_SET(pt->e[i], 0, (flags | PTE_FLG_TO_ALLOC) & (~PTE_FLG_PRESENT));
+			}
+		}
+		PTE_CNT_ADD(pd->e[i2], cnt);
+next:
+		vaddr += cnt << PAGE_SIZE_SHIFT;
+		if (huge) {
+			paddr += cnt << PAGE_SIZE_SHIFT;
+		}
+		n -= cnt;
+	}
+}
+
+// Internal free function to reduce code. Clears the entries in one page table at a time, and frees
+// tables which become empty. Invalidations are gathered, so that the TLB is flushed once for the
+// whole range, before the frames are freed. Huge pages which are only partly in the range are split
+// first
 static void _do_free(vaddr_t vaddr, uint64_t n, bool do_free) {
-	struct ptable *pml4, *pdp, *pd, *pt;
-	uint64_t idx, i, j;
-	bool flag;
-	paddr_t paddr;
+	struct ptable *pml4, *pdp = NULL, *pd = NULL, *pt;
+	uint64_t i4, i3, i2, idx, i, cnt, entry;
+	struct tlb_gather tlb;
 	// Check we're initialized
 	ASSERT(_PMMGR);
 	// Check if address is valid
 	ASSERT(vaddr);
 	ASSERT(VADDR_IS_VALID(vaddr));
 	ASSERT(!(vaddr & 0xfff));
-	pml4 = (struct ptable*) PML4_VADDR;
-	for (i = 0; i < n; i++) {
-		ASSERT(pdp = _pt_child(pml4, PML4_IDX(vaddr)));
-		ASSERT(pd = _pt_child(pdp, PDP_IDX(vaddr)));
-		ASSERT(pt = _pt_child(pd, PD_IDX(vaddr)));
-		idx = PT_IDX(vaddr);
-		// The entry shouldn't be unused because that's what we're going to do now
-		ASSERT(!PTE_UNUSED(pt->e[idx]));
-		if (do_free) {
-			paddr = PTE_PADDR(pt->e[idx]);
-			_PMMGR->free(paddr);
+	_tlb_gather_init(&tlb);
+	pml4 = (struct ptable*) _phys(_target_pml4());
+	while (n) {
+		i4 = PML4_IDX(vaddr);
+		i3 = PDP_IDX(vaddr);
+		i2 = PD_IDX(vaddr);
+		if (!pdp || IS_ALIGNED(vaddr, PDP_SPAN)) {
+			ASSERT(pdp = _pt_child(pml4, i4));
 		}
-		pt->e[idx] = 0;
-		invlpg(vaddr);
-		// If tables are empty, free tables
-		flag = 1;
-		for (j = 0; j < 512; j++) {
-			if (!PTE_UNUSED(pt->e[j])) {
-				flag = 0;
-				break;
+		if (PTE_HUGE(pdp->e[i3])) {
+			if (IS_ALIGNED(vaddr, PD_SPAN) && n >= (PD_SPAN >> PAGE_SIZE_SHIFT)) {
+				_tlb_gather_range(&tlb, vaddr, PD_SPAN >> PAGE_SIZE_SHIFT);
+				_huge_clear(&pdp->e[i3], PD_SPAN, do_free, &tlb);
+				cnt = PD_SPAN >> PAGE_SIZE_SHIFT;
+				pd = NULL;
+				goto put_pdp;
 			}
+			_pt_split(pdp, i3, PD_SPAN, vaddr);
+			pd = NULL;
 		}
-		if (!flag) {
-			vaddr += PAGE_SIZE;
-			continue;
+		if (!pd || IS_ALIGNED(vaddr, PD_SPAN)) {
+			ASSERT(pd = _pt_child(pdp, i3));
 		}
-		idx = PD_IDX(vaddr);
-		paddr = PTE_PADDR(pd->e[idx]);
-		_PMMGR->free(paddr);
-		pd->e[idx] = 0;
-		flag = 1;
-		for (j = 0; j < 512; j++) {
-			if (!PTE_UNUSED(pd->e[j])) {
-				flag = 0;
-				break;
+		if (PTE_HUGE(pd->e[i2])) {
+			if (IS_ALIGNED(vaddr, PT_SPAN) && n >= (PT_SPAN >> PAGE_SIZE_SHIFT)) {
+				_tlb_gather_range(&tlb, vaddr, PT_SPAN >> PAGE_SIZE_SHIFT);
+				_huge_clear(&pd->e[i2], PT_SPAN, do_free, &tlb);
+				cnt = PT_SPAN >> PAGE_SIZE_SHIFT;
+				goto put_pd;
 			}
+			_pt_split(pd, i2, PT_SPAN, vaddr);
 		}
-		if (!flag) {
-			vaddr += PAGE_SIZE;
-			continue;
-		}
-		idx = PDP_IDX(vaddr);
-		paddr = PTE_PADDR(pdp->e[idx]);
-		_PMMGR->free(paddr);
-		pdp->e[idx] = 0;
-		for (j = 0; j < 512; j++) {
-			if (!PTE_UNUSED(pdp->e[j])) {
-				flag = 0;
-				break;
+		ASSERT(pt = _pt_child(pd, i2));
+		idx = PT_IDX(vaddr);
+		cnt = PT_NUM_ENTRIES - idx < n ? PT_NUM_ENTRIES - idx : n;
+		for (i = idx; i < idx + cnt; i++) {
+			// The entry shouldn't be unused because that's what we're going to do now
+			ASSERT(!PTE_UNUSED(pt->e[i]));
+			entry = pt->e[i];
+			pt->e[i] = 0;
+			// Pages which were never touched are not in the TLB, and don't have a frame to free
+			if (PTE_PRESENT(entry)) {
+				_tlb_gather_range(&tlb, vaddr + ((i - idx) << PAGE_SIZE_SHIFT), 1);
+				if (do_free) {
+					_tlb_gather_frames(&tlb, PTE_PADDR(entry), 1);
+				}
 			}
 		}
-		if (!flag) {
-			vaddr += PAGE_SIZE;
-			continue;
+		// If tables are empty, free tables
+		PTE_CNT_SUB(pd->e[i2], cnt);
+		if (PTE_CNT(pd->e[i2])) {
+			goto next;
+		}
+		_pt_free(pd, i2, vaddr, &tlb);
+put_pd:
+		PTE_CNT_SUB(pdp->e[i3], 1);
+		if (PTE_CNT(pdp->e[i3])) {
+			goto next;
+		}
+		_pt_free(pdp, i3, vaddr, &tlb);
+		pd = NULL;
+put_pdp:
+		PTE_CNT_SUB(pml4->e[i4], 1);
+		if (PTE_CNT(pml4->e[i4])) {
+			goto next;
 		}
-		idx = PML4_IDX(vaddr);
-		paddr = PTE_PADDR(pml4->e[idx]);
-		_PMMGR->free(paddr);
-		pml4->e[idx] = 0;
-		vaddr += PAGE_SIZE;
+		_pt_free(pml4, i4, vaddr, &tlb);
+		pdp = NULL;
+next:
+		vaddr += cnt << PAGE_SIZE_SHIFT;
+		n -= cnt;
 	}
+	_tlb_gather_flush(&tlb);
 }
 
-// Set up a PML4. Allocate a frame, zero it out, map to itself at index 510. Return paddr
+// Set up a PML4. Allocate a zeroed frame. Return paddr
 static paddr_t _setup_new_pml4() {
-	struct ptable *ptr;
-	paddr_t paddr;
-	// Allocate a frame for the PML4
-	ASSERT((paddr = _PMMGR->alloc()) != PADDR_INVALID);
-	// Map it to a temporary address
-	vmm_map_to(TEMP_VADDR, paddr, 1, PTE_FLG_PRESENT | PTE_FLG_WRITABLE);
-	ptr = (struct ptable *) TEMP_VADDR;
-	// Zero it out
-	memset(ptr, 0, PAGE_SIZE);
-	// Map 510th entry to itself
-	ptr->e[510] = paddr | PTE_FLG_PRESENT | PTE_FLG_WRITABLE;
-	// Unmap the temporary page and return
-	vmm_unmap(TEMP_VADDR, 1);
-	return paddr;
+	return _pt_alloc();
 }
 
-// Call a function with a new PML4, and then restore the current PML4
-static void _do_with_new_pml4(paddr_t pml4_frame, void (*fn) (void)) {
-	struct ptable *ptr;
+// Call a function with the given PML4 as the target of mapping operations, and then restore the
+// current target. Page tables are reached directly. The target is per-CPU, and interrupts are off
+// so that handlers don't map into it. invlpg only affects the current PCID, so if the PML4 is not
+// current, TLB entries it has left behind are dropped by forgetting its PCID
+static void _do_with_pml4(paddr_t pml4_frame, void (*fn) (void)) {
 	paddr_t backup;
-	// Backup up current PML4 paddr
-	backup = read_cr3() & PTE_PADDR_MASK;
-	// Map the temporary page to backup frame
-	vmm_map_to(TEMP_VADDR, backup, 1, PTE_FLG_PRESENT | PTE_FLG_WRITABLE);
-	// Overwrite the recursive mapping and map it to temporary pml4
-	ptr = (struct ptable *) TEMP_VADDR;
-	ptr->e[510] = pml4_frame | PTE_FLG_PRESENT | PTE_FLG_WRITABLE;
-	// Invalidate whole TLB
-	tlb_flush_all();
-	// Execute the function in the new context
+	uint32_t cpu;
+	bool intr;
+	intr = sys_int_enabled();
+	sys_disable_int();
+	cpu = cpu_get_id();
+	backup = _target[cpu];
+	_target[cpu] = pml4_frame;
 	fn();
-	// Restore recursive mapping
-	ptr->e[510] = backup | PTE_FLG_PRESENT | PTE_FLG_WRITABLE;
-	tlb_flush_all();
-	// Unmap the remporary page mapiping
-	vmm_unmap(TEMP_VADDR, 1);
+	_target[cpu] = backup;
+	if (intr) {
+		sys_enable_int();
+	}
+	if (_pcid_enabled && (read_cr3() & CR3_PML4_PADDR_MASK) != pml4_frame) {
+		_pcid_forget(pml4_frame);
+	}
+}
+
+// Map all physical memory upto _physmap_end at KRNL_PHYSMAP_START. Alignment allows the largest
+// pages the CPU supports
+static void _map_physmap() {
+	paddr_t end = ROUND_UP(_physmap_end, PT_SPAN);
+	if (end > KRNL_PHYSMAP_SIZE) {
+		PANIC("Physical memory too large for physmap: %#llx\n", end);
+	}
+	_do_map(KRNL_PHYSMAP_START, 0, end >> PAGE_SIZE_SHIFT, PTE_FLG_WRITABLE | PTE_FLG_NO_EXEC);
 }
 
 // Page fault handler
@@ -230,69 +784,169 @@ static void __attribute__((naked)) _isr_page_fault() {
 }
 
 // Initialize the virtual memory management subsystem with the given underlying pmmgr
-// Set up a new page table, with the callback provided (Panic if not provided)
+// Set up a new page table, with the callback provided (Panic if not provided), and a physmap of
+// physical memory upto mem_end
 // Switch to the new address space
-void vmm_init(struct pmmgr *pmmgr, void (*remap_cb) (void)) {
+void vmm_init(struct pmmgr *pmmgr, void (*remap_cb) (void), paddr_t mem_end) {
 	paddr_t pml4_paddr;
 
+	uint32_t a, b, c, d;
+
 	ASSERT(!_PMMGR);
 	ASSERT(pmmgr);
 	ASSERT(remap_cb);
 	_PMMGR = pmmgr;
 
+	// Check for 1G page support
+	cpuid(0x80000001, 0, &a, &b, &c, &d);
+	_gb_pages = (d & CPUID_EXT_EDX_PDPE1GB) != 0;
+
+	// Enable PCIDs if supported. The boot CR3 has PCID 0
+	cpuid(1, 0, &a, &b, &c, &d);
+	if (c & CPUID_ECX_PCID) {
+		write_cr4(read_cr4() | CR4_PCID_ENABLE);
+		_pcid_enabled = true;
+	}
+
+	// Until we switch, reach page tables through the boot mapping
+	_physbase = KRNL_VBASE;
+
 	// Allocate new PML4
 	pml4_paddr = _setup_new_pml4();
 
 	// Remap the kernel with the new PML4
-	_do_with_new_pml4(pml4_paddr, remap_cb);
+	_do_with_pml4(pml4_paddr, remap_cb);
+
+	// Map physical memory
+	_physmap_end = mem_end;
+	_do_with_pml4(pml4_paddr, _map_physmap);
 
 	// Remap the physical memory manager if it requires it
 	if (_PMMGR->remap_cb) {
-		_do_with_new_pml4(pml4_paddr, _PMMGR->remap_cb);
+		_do_with_pml4(pml4_paddr, _PMMGR->remap_cb);
 	}
 
-	// Enable noexec and write protection (TODO)
+	// Enable noexec, write protection (TODO) and global pages
 	set_nx();
 	set_write_protect();
+	set_global_pages();
 
-	// Switch to new address space
+	// Switch to new address space. From now on, reach page tables through the physmap
+	_physbase = KRNL_PHYSMAP_START;
 	vmm_switch_addr_space(pml4_paddr);
 
 	// Set page fault handler
 	isr_set_gate(14, _isr_page_fault, 0, 0x08, IDT_ATTR_PRESENT | IDT_ATTR_INT_32);
+
+#ifdef __TMOS_CFG_SMP__
+	// Set TLB shootdown handler
+	isr_set_gate(VMM_SHOOTDOWN_VECTOR, _isr_shootdown, 0, 0x08, IDT_ATTR_PRESENT | IDT_ATTR_INT_32);
+#endif
 }
 
-// Switch address space to PML4 at given paddr, and return paddr of current PML4
+// Switch address space to PML4 at given paddr, and return paddr of current PML4. With PCIDs, the
+// TLB entries of recently used address spaces survive the switch
 paddr_t vmm_switch_addr_space(paddr_t new_pml4_addr) {
-	paddr_t ret = read_cr3() & PTE_PADDR_MASK;
-	write_cr3(new_pml4_addr);
+	paddr_t ret, evicted = 0;
+	uint64_t cr3;
+	bool intr;
+	intr = sys_int_enabled();
+	sys_disable_int();
+	// Switching means we're going to touch user mappings
+	vmm_lazy_exit();
+	ret = read_cr3() & CR3_PML4_PADDR_MASK;
+	if (_pcid_enabled) {
+		cr3 = _pcid_cr3(new_pml4_addr, &evicted);
+	} else {
+		cr3 = new_pml4_addr;
+	}
+	_tlb_cpu_switch(ret, new_pml4_addr, evicted);
+	write_cr3(cr3);
+	if (intr) {
+		sys_enable_int();
+	}
 	return ret;
 }
 
+// Forget the PCID of an address space, so that none of its TLB entries are reused. Must be called
+// before its PML4 is freed, or after its tables are changed while it is not current
+void vmm_forget_addr_space(paddr_t pml4_addr) {
+	if (_pcid_enabled) {
+		_pcid_forget(pml4_addr);
+	}
+}
+
+// Enter lazy TLB mode. Until vmm_lazy_exit, this CPU promises not to touch user mappings, so it is
+// not interrupted when they change. Meant for idle CPUs
+void vmm_lazy_enter() {
+#ifdef __TMOS_CFG_SMP__
+	__atomic_store_n(&_cpu_tlb[cpu_get_id()].lazy, true, __ATOMIC_SEQ_CST);
+#endif
+}
+
+// Leave lazy TLB mode, flushing user mappings if they changed meanwhile. Called with interrupts
+// disabled
+void vmm_lazy_exit() {
+#ifdef __TMOS_CFG_SMP__
+	struct cpu_tlb *state = &_cpu_tlb[cpu_get_id()];
+	if (!__atomic_load_n(&state->lazy, __ATOMIC_SEQ_CST)) {
+		return;
+	}
+	__atomic_store_n(&state->lazy, false, __ATOMIC_SEQ_CST);
+	if (__atomic_exchange_n(&state->stale, false, __ATOMIC_SEQ_CST)) {
+		tlb_flush_all();
+	}
+#endif
+}
+
+// Handle the TLB shootdown requests queued for this CPU. Called by spinlocks while they wait, since
+// they may spin with interrupts disabled while the lock holder waits for this CPU to flush
+void vmm_shootdown_poll() {
+#ifdef __TMOS_CFG_SMP__
+	_shootdown_handle();
+#endif
+}
+
+#ifdef __TMOS_CFG_SMP__
+
+// Add this CPU to those taking part in TLB shootdowns. Called by each CPU once its local APIC is
+// enabled, and after page descriptors are set up. The loaded address space may have been switched
+// to before that, so add this CPU to its mask here
+void vmm_cpu_online() {
+	uint32_t cpu = cpu_get_id(), *mask;
+	_cpu_tlb[cpu].queue = NULL;
+	_cpu_tlb[cpu].pml4 = read_cr3() & CR3_PML4_PADDR_MASK;
+	_cpu_tlb[cpu].lazy = _cpu_tlb[cpu].stale = false;
+	if ((mask = _as_cpus(_cpu_tlb[cpu].pml4))) {
+		__atomic_or_fetch(mask, 1 << cpu, __ATOMIC_SEQ_CST);
+	}
+	__atomic_or_fetch(&_cpus_online, 1 << cpu, __ATOMIC_SEQ_CST);
+}
+
+// The handler called by the shootdown IPI handler
+void vmm_shootdown_handler() {
+	_shootdown_handle();
+	lapic_send_eoi();
+}
+
+// Get shootdown statistics
+void vmm_shootdown_stats(struct vmm_shootdown_stats *stats) {
+	*stats = _shootdown_stats;
+}
+
+#endif // __TMOS_CFG_SMP__
+
+// Check that the fault-around window passed with mapping flags fits in a page table
+static inline void _check_fault_around(uint64_t flags) {
+	if ((flags & PTE_FAULT_AROUND_MASK) > PTE_FAULT_AROUND(9)) {
+		PANIC("Fault-around order too large: %llu\n", ((flags & PTE_FAULT_AROUND_MASK) >> 52) - 1);
+	}
+}
+
 // Allocate and map n virtual memory pages with the given flags, at the given addresss
 void vmm_map(vaddr_t vaddr, uint64_t n, uint64_t flags) {
-	struct ptable *pml4, *pdp, *pd, *pt;
-	uint64_t idx, i;
-	// Check we're initialized
-	ASSERT(_PMMGR);
-	// Check if addresses are valid
-	ASSERT(vaddr);
-	ASSERT(VADDR_IS_VALID(vaddr));
-	ASSERT(!(vaddr & 0xfff));
-	// If tables are not present, create then. If couldn't create, panic
-	pml4 = (struct ptable*) PML4_VADDR;
-	for (i = 0; i < n; i++) {
-		ASSERT(pdp = _pt_create(pml4, PML4_IDX(vaddr)));
-		ASSERT(pd = _pt_create(pdp, PDP_IDX(vaddr)));
-		ASSERT(pt = _pt_create(pd, PD_IDX(vaddr)));
-		idx = PT_IDX(vaddr);
-		// Check that PT entry is unused
-		ASSERT(PTE_UNUSED(pt->e[idx]));
-		// Mark as to be allocated
-		PTE_SET(pt->e[idx], 0, (flags | PTE_FLG_TO_ALLOC) & (~PTE_FLG_PRESENT));
-		// Go to next page
-		vaddr += PAGE_SIZE;
-	}
+	_check_fault_around(flags);
+	_do_map(vaddr, PADDR_INVALID, n, flags);
 }
 
 // Free n virtual memory pages
@@ -307,7 +961,7 @@ paddr_t vmm_translate(vaddr_t vaddr) {
 	vaddr_t off, pd_off, pdp_off;
 	// Check if vaddr is valid
 	ASSERT(VADDR_IS_VALID(vaddr));
-	pml4 = (struct ptable*) PML4_VADDR;
+	pml4 = _cur_pml4();
 	// Get offset into ptable
 	off = vaddr & 0xfff;
 	pd_off = vaddr & ((0x1000 << 9) - 1);
@@ -345,29 +999,9 @@ paddr_t vmm_translate(vaddr_t vaddr) {
 
 // Map n virtual page to a given physical frame with the given flags
 void vmm_map_to(vaddr_t vaddr, paddr_t paddr, uint64_t n, uint64_t flags) {
-	struct ptable *pml4, *pdp, *pd, *pt;
-	uint64_t idx, i;
-	// Check we're initialized
-	ASSERT(_PMMGR);
-	// Check if addresses are valid
-	ASSERT(vaddr);
-	ASSERT(VADDR_IS_VALID(vaddr));
-	ASSERT(!(vaddr & 0xfff));
-	ASSERT(!(paddr & ~PADDR_ALGN_MASK));
-	// If tables are not present, create then. If couldn't create, panic
-	pml4 = (struct ptable*) PML4_VADDR;
-	for (i = 0; i < n; i++) {
-		ASSERT(pdp = _pt_create(pml4, PML4_IDX(vaddr)));
-		ASSERT(pd = _pt_create(pdp, PDP_IDX(vaddr)));
-		ASSERT(pt = _pt_create(pd, PD_IDX(vaddr)));
-		idx = PT_IDX(vaddr);
-		// Check that PT entry is unused
-		ASSERT(PTE_UNUSED(pt->e[idx]));
-		PTE_SET(pt->e[idx], paddr, flags | PTE_FLG_PRESENT);
-		// Go to next page
-		vaddr += PAGE_SIZE;
-		paddr += PAGE_SIZE;
-	}
+	ASSERT(paddr != PADDR_INVALID);
+	_check_fault_around(flags);
+	_do_map(vaddr, paddr, n, flags);
 }
 
 // Unmap n virtual memory pages
@@ -395,12 +1029,47 @@ void* ksbrk(intptr_t increment) {
 	return ret;
 }
 
+// Allocate a zeroed frame. Take it from the pool of pre-zeroed frames if possible
+paddr_t vmm_alloc_zeroed() {
+	paddr_t paddr;
+	ASSERT(_physbase == KRNL_PHYSMAP_START);
+	if ((paddr = _zpool_take()) != PADDR_INVALID) {
+		return paddr;
+	}
+	if ((paddr = _PMMGR->alloc()) == PADDR_INVALID) {
+		return PADDR_INVALID;
+	}
+	_zero_page(_phys(paddr));
+	return paddr;
+}
+
+// Zero a batch of frames into the pool of pre-zeroed frames. Meant to be called when idle
+void vmm_zero_idle() {
+	paddr_t paddr;
+	uint32_t i;
+	ASSERT(_physbase == KRNL_PHYSMAP_START);
+	for (i = 0; i < VMM_ZPOOL_BATCH && _zpool.num < VMM_ZPOOL_SIZE; i++) {
+		if ((paddr = _PMMGR->alloc()) == PADDR_INVALID) {
+			return;
+		}
+		_zero_page(_phys(paddr));
+		spin_lock_intsafe(&_zpool.lock);
+		if (_zpool.num == VMM_ZPOOL_SIZE) {
+			spin_unlock(&_zpool.lock);
+			_PMMGR->free(paddr);
+			return;
+		}
+		_zpool.frames[_zpool.num++] = paddr;
+		spin_unlock(&_zpool.lock);
+	}
+}
+
 // Print the page table structure
 void vmm_print_ptable() {
 	uint64_t i, j, k, l;
 	vaddr_t vaddr;
 	struct ptable *pml4, *pdp, *pd, *pt;
-	pml4 = (struct ptable*) PML4_VADDR;
+	pml4 = _cur_pml4();
 	klog("\nPML4: %#llx\n", pml4);
 	for (i = 0; i < 512; i++) {
 		if (PTE_UNUSED(pml4->e[i])) {
@@ -447,11 +1116,35 @@ void invlpg(vaddr_t addr) {
 	__asm__ __volatile__ ("invlpg [%0]\n" : : "r"(addr) : "memory");
 }
 
-// Invalidate the whole TLP
+// Invalidate the whole TLP. Reloading CR3 without the no-flush bit only flushes the current PCID
 void tlb_flush_all() {
 	__asm__ __volatile__ ("mov rax, cr3; mov cr3, rax\n" : : : "rax", "memory");
 }
 
+// Invalidate the whole TLB, including global entries. Changing CR4.PGE flushes everything
+void tlb_flush_global() {
+	uint64_t cr4 = read_cr4();
+	write_cr4(cr4 ^ CR4_PAGE_GLOB_ENABLE);
+	write_cr4(cr4);
+}
+
+// Invalidate n pages starting at addr. Large ranges flush the whole TLB instead. invlpg drops global
+// entries too, but reloading CR3 doesn't, so large kernel ranges need a global flush
+void tlb_flush_range(vaddr_t addr, uint64_t n) {
+	if (n > VMM_FLUSH_ALL_THRESHOLD) {
+		if (VADDR_IS_KERNEL(addr)) {
+			tlb_flush_global();
+		} else {
+			tlb_flush_all();
+		}
+		return;
+	}
+	while (n--) {
+		invlpg(addr);
+		addr += PAGE_SIZE;
+	}
+}
+
 
 // PAGE FAULT HANDLER
 
@@ -462,11 +1155,61 @@ void tlb_flush_all() {
 #define ERR_CODE_RSVD    8
 #define ERR_CODE_INSTR   16
 
+// Demand paging statistics. Not exact, since they are updated without locks
+static struct vmm_fault_stats _fault_stats = { 0 };
+
+// Allocate a frame for an entry marked for allocation. Return false if out of memory
+static bool _fault_in(uint64_t *entry) {
+	paddr_t paddr;
+	uint64_t flags = PTE_FLAGS(*entry);
+	// User pages must not leak old contents
+	if (flags & PTE_FLG_USER_ACCESS) {
+		paddr = vmm_alloc_zeroed();
+	} else {
+		paddr = _PMMGR->alloc();
+	}
+	if (paddr == PADDR_INVALID) {
+		return false;
+	}
+	flags = (flags | PTE_FLG_PRESENT) & ~(PTE_FLG_TO_ALLOC | PTE_FAULT_AROUND_MASK);
+	PTE_SET(*entry, paddr, flags);
+	return true;
+}
+
+// Allocate the untouched pages in the fault-around window around the faulting entry at idx, while
+// the table is hot. window is the fault-around field of the faulting entry. Only entries with the
+// same window are allocated, so that mappings which asked for no fault-around don't get it from a
+// neighbour. Not-present entries are never cached, so no flush is needed. This is opportunistic, so
+// stop if memory runs out
+static void _fault_around(struct ptable *pt, uint64_t idx, uint64_t window) {
+	uint64_t order, start, end, i;
+	order = window >> 52;
+	order = order ? order - 1 : VMM_FAULT_AROUND_ORDER;
+	if (!order) {
+		return;
+	}
+	start = ROUND_DOWN(idx, (uint64_t) 1 << order);
+	end = start + ((uint64_t) 1 << order);
+	for (i = start; i < end; i++) {
+		if (!PTE_TO_ALLOC(pt->e[i]) || (pt->e[i] & PTE_FAULT_AROUND_MASK) != window) {
+			continue;
+		}
+		if (!_fault_in(&pt->e[i])) {
+			break;
+		}
+		_fault_stats.around++;
+	}
+}
+
+// Get demand paging statistics
+void vmm_fault_stats(struct vmm_fault_stats *stats) {
+	*stats = _fault_stats;
+}
+
 // The handler called by the asm handler
 void vmm_page_fault_handler(vaddr_t addr, vaddr_t rip, uint64_t err) {
 	struct ptable *pml4, *pdp, *pd, *pt;
-	paddr_t paddr;
-	uint64_t idx, flags;
+	uint64_t idx, window;
 	klog("Page fault at %#llx, RIP: %#llx, ERR: %#llx\n", addr, rip, err);
 	// If it's a no-exec fault, then abort
 	if (err & ERR_CODE_INSTR) {
@@ -480,7 +1223,7 @@ void vmm_page_fault_handler(vaddr_t addr, vaddr_t rip, uint64_t err) {
 	}
 	// If it's not present, but was marked for allocation, allocate it
 	if (!(err & ERR_CODE_PRESENT)) {
-		pml4 = (struct ptable*) PML4_VADDR;
+		pml4 = _cur_pml4();
 		if (!(pdp = _pt_child(pml4, PML4_IDX(addr)))
 		    || !(pd = _pt_child(pdp, PDP_IDX(addr)))
 		    || !(pt = _pt_child(pd, PD_IDX(addr)))) {
@@ -490,10 +1233,10 @@ void vmm_page_fault_handler(vaddr_t addr, vaddr_t rip, uint64_t err) {
 		idx = PT_IDX(addr);
 		// TODO: Swapping
 		if (PTE_TO_ALLOC(pt->e[idx])) {
-			ASSERT((paddr = _PMMGR->alloc()) != PADDR_INVALID);
-			flags = PTE_FLAGS(pt->e[idx]);
-			flags = (flags | PTE_FLG_PRESENT) & ~PTE_FLG_TO_ALLOC;
-			PTE_SET(pt->e[idx], paddr, flags);
+			window = pt->e[idx] & PTE_FAULT_AROUND_MASK;
+			ASSERT(_fault_in(&pt->e[idx]));
+			_fault_stats.faults++;
+			_fault_around(pt, idx, window);
 			return;
 		}
 		klog("Rogue pointer: %#llx. Abort\n", addr);
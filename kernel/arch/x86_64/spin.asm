@@ -7,6 +7,10 @@ global spin_lock
 global spin_lock_intsafe
 global spin_unlock
 
+; A CPU holding a lock may be waiting for us to handle a TLB shootdown, so handle them while
+; waiting for a lock, even with IRQs disabled
+extern vmm_shootdown_poll
+
 
 section .text.spin_lock
 ; Params - RDI = spin_t *lock
@@ -15,6 +19,9 @@ spin_lock:
 	jnc	.acquired        ; Lock was previously 0, so acquired
 .retry:
 	pause                    ; Don't waste CPU resources
+	push	rdi
+	call	vmm_shootdown_poll  ; Handle TLB shootdowns meanwhile
+	pop	rdi
 	bt	dword [rdi], 0   ; Check if bit 0 is set
 	jc	.retry           ; Yes, poll again
 	lock bts dword [rdi], 0  ; Set bit 0 and return previous value in CF
@@ -36,6 +43,13 @@ spin_lock_intsafe:
 .retry:
 	sti                      ; Enable IRQs for polling
 	pause                    ; Don't waste CPU resources
+	push	rdi
+	push	rax              ; Original flags
+	sub	rsp, 8           ; Keep the stack 16-byte aligned for the call
+	call	vmm_shootdown_poll  ; Handle TLB shootdowns meanwhile
+	add	rsp, 8
+	pop	rax
+	pop	rdi
 	bt	dword [rdi], 0   ; Check if bit 0 is set
 	jc	.retry           ; Yes, poll again
 	cli                      ; Disable IRQs in the hope of acquiring lock
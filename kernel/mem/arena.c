@@ -0,0 +1,91 @@
+// (C) 2018 Srimanta Barua
+//
+// Arena allocator.
+//
+// An arena is a chain of blocks of pages. Memory is allocated by bumping a pointer in the newest
+// block, and when it doesn't fit, a new block is added. Resetting the arena frees every block but
+// the first, which also holds the arena itself.
+
+#include <tmos/memory.h>
+#include <tmos/system.h>
+#include <tmos/klog.h>
+
+// A block of pages in an arena
+struct arena_block {
+	struct arena_block *next; // Next older block
+	uint64_t npages;          // Size of the block
+};
+
+// An arena
+struct arena {
+	struct arena_block *cur;  // Block we're allocating from
+	void *ptr, *end;          // Free part of the current block
+	uint64_t npages;          // Default size of new blocks
+	struct arena_block first; // The first block, which holds the arena
+};
+
+// Create an arena. The size is a hint for how much memory to set aside at a time
+struct arena* arena_create(size_t size) {
+	struct arena *arena;
+	uint64_t npages;
+	npages = PAGE_ALGN_UP(size + sizeof(struct arena)) >> PAGE_SIZE_SHIFT;
+	arena = kmalloc_pages(npages);
+	arena->first.next = NULL;
+	arena->first.npages = npages;
+	arena->npages = npages;
+	arena->cur = &arena->first;
+	arena_reset(arena);
+	return arena;
+}
+
+// Destroy an arena, freeing all memory allocated from it
+void arena_destroy(struct arena *arena) {
+	ASSERT(arena);
+	arena_reset(arena);
+	kfree_pages(arena);
+}
+
+// Allocate memory of the given size from an arena
+void* arena_alloc(struct arena *arena, size_t size) {
+	struct arena_block *block;
+	uint64_t npages;
+	void *ret;
+	ASSERT(arena);
+	if (!size) {
+		return NULL;
+	}
+	size = ROUND_UP(size, WORD_SIZE >> 3);
+	// Fast path. Bump the pointer
+	if (arena->end - arena->ptr >= (intptr_t) size) {
+		ret = arena->ptr;
+		arena->ptr += size;
+		return ret;
+	}
+	// Doesn't fit. Add a new block
+	npages = PAGE_ALGN_UP(size + sizeof(struct arena_block)) >> PAGE_SIZE_SHIFT;
+	if (npages < arena->npages) {
+		npages = arena->npages;
+	}
+	block = kmalloc_pages(npages);
+	block->next = arena->cur;
+	block->npages = npages;
+	arena->cur = block;
+	ret = (void*) (block + 1);
+	arena->ptr = ret + size;
+	arena->end = (void*) block + (npages << PAGE_SIZE_SHIFT);
+	return ret;
+}
+
+// Free all memory allocated from an arena, keeping the arena itself
+void arena_reset(struct arena *arena) {
+	struct arena_block *block;
+	ASSERT(arena);
+	while (arena->cur != &arena->first) {
+		block = arena->cur;
+		arena->cur = block->next;
+		kfree_pages(block);
+	}
+	arena->cur = &arena->first;
+	arena->ptr = (void*) (arena + 1);
+	arena->end = (void*) arena + (arena->first.npages << PAGE_SIZE_SHIFT);
+}
@@ -12,7 +12,7 @@ struct bm_pmmgr {
 	struct bitmap bm0, bm1;
 };
 
-// TODO: Locking
+// Not locked. Callers which need it should go through PCPU_PMMGR
 static struct bm_pmmgr _mgr = { 0 };
 
 // Set a bit in memory manager's bitmap, and also upper level bitmap if required
@@ -24,13 +24,10 @@ static void _set(paddr_t bit) {
 	}
 }
 
-// Unet a bit in memory manager's bitmap, and also upper level bitmap if required
+// Unset a bit in memory manager's bitmap. The word is no longer full, so also unset upper level
 static void _unset(paddr_t bit) {
 	BM_UNSET(_mgr.bm0, bit);
-	bit >>= WORD_SIZE_SHIFT;
-	if (_mgr.bm0.map[bit] == 0) {
-		BM_UNSET(_mgr.bm1, bit);
-	}
+	BM_UNSET(_mgr.bm1, bit >> WORD_SIZE_SHIFT);
 }
 
 // Mark memory as used
@@ -111,43 +108,42 @@ static void _init(region_t *regions, uint32_t num_regions, paddr_t fast_start, p
 	_mark_used(REGION_START(regions[bmreg]), REGION_START(regions[bmreg]) + bm_sz);
 }
 
+// Get the frame range for the fast allocator
+static void _fast_range(paddr_t *start, paddr_t *end) {
+	*start = _mgr.fast_start > _mgr.base ? (_mgr.fast_start - _mgr.base) >> PAGE_SIZE_SHIFT : 0;
+	*end = _mgr.fast_end > _mgr.base ? (_mgr.fast_end - _mgr.base) >> PAGE_SIZE_SHIFT : 0;
+	if (*end > _mgr.tot_blk) {
+		*end = _mgr.tot_blk;
+	}
+}
+
 // Allocate one frame (for fast allocator)
 static paddr_t _alloc() {
-	paddr_t i, j, bm1_nw, bm0_nw, bm0_startw, bm0_endw, bm1_startw, bm1_endw;
+	paddr_t start, end, w, bits;
 	if (_mgr.used_blk == _mgr.tot_blk) {
 		return PADDR_INVALID;
 	}
-	bm0_nw = ROUND_UP(_mgr.tot_blk, WORD_SIZE) >> WORD_SIZE_SHIFT;
-	bm1_nw = ROUND_UP(bm0_nw, WORD_SIZE) >> WORD_SIZE_SHIFT;
-
-	// We should know our limits
-	bm0_startw = ROUND_UP(_mgr.fast_start >> PAGE_SIZE_SHIFT, WORD_SIZE) >> WORD_SIZE_SHIFT;
-	bm0_endw = ROUND_DOWN(_mgr.fast_end >> PAGE_SIZE_SHIFT, WORD_SIZE) >> WORD_SIZE_SHIFT;
-	bm1_startw = ROUND_UP(bm0_startw, WORD_SIZE) >> WORD_SIZE_SHIFT;
-	bm1_endw = ROUND_DOWN(bm0_endw, WORD_SIZE) >> WORD_SIZE_SHIFT;
-
-	// Find bm1 word which is not full
-	for (i = bm1_startw; i < bm1_nw && i < bm1_endw; i++) {
-		if (_mgr.bm1.map[i] == WORD_MAX) {
-			continue;
+	_fast_range(&start, &end);
+	// Find bm0 word which is not full through bm1, and then the clear bit in that word
+	w = bm_find_first_zero(&_mgr.bm1, start >> WORD_SIZE_SHIFT);
+	while (w < _mgr.bm1.num_bits && (w << WORD_SIZE_SHIFT) < end) {
+		bits = ~_mgr.bm0.map[w];
+		// The first word may be partially outside our limits
+		if (w == (start >> WORD_SIZE_SHIFT)) {
+			bits &= WORD_MAX << (start & (WORD_SIZE - 1));
 		}
-		// Found bm1 word. Found bit which is clear
-		for (j = 0; j < WORD_SIZE; j++) {
-			if ((_mgr.bm1.map[i] & (1 << j)) == 0) {
-				break;
-			}
+		if (!bits) {
+			w = bm_find_first_zero(&_mgr.bm1, w + 1);
+			continue;
 		}
-		// We know j < WORD_SIZE. Found bm0 word. Find bit in that word
-		i = (i << WORD_SIZE_SHIFT) + j;
-		for (j = 0; j < WORD_SIZE; j++) {
-			if ((_mgr.bm0.map[i] & (1 << j)) == 0) {
-				// Found frame
-				i = (i << WORD_SIZE_SHIFT) + j;
-				_set(i);
-				return (i << PAGE_SIZE_SHIFT) + _mgr.base;
-			}
+		// Found frame
+		w = (w << WORD_SIZE_SHIFT) + __BM_WORD_FFS(bits);
+		if (w >= end) {
+			break;
 		}
-		PANIC("unreachable");
+		_set(w);
+		_mgr.used_blk++;
+		return (w << PAGE_SIZE_SHIFT) + _mgr.base;
 	}
 	return PADDR_INVALID;
 }
@@ -157,9 +153,10 @@ static void _free(paddr_t addr) {
 	ASSERT((addr & ~PADDR_ALGN_MASK) == 0);
 	ASSERT(addr >= _mgr.fast_start);
 	ASSERT(addr < _mgr.fast_end);
-	addr >>= PAGE_SIZE_SHIFT;
+	addr = (addr - _mgr.base) >> PAGE_SIZE_SHIFT;
 	ASSERT(BM_TEST(_mgr.bm0, addr));
 	_unset(addr);
+	_mgr.used_blk--;
 }
 
 // Remap the space taken by the bitmap
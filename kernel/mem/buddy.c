@@ -0,0 +1,292 @@
+// (C) 2018 Srimanta Barua
+//
+// Binary buddy physical memory manager
+//
+// Memory is handed out in blocks of 2^order frames, for orders 0 to BUDDY_MAX_ORDER. For each order
+// there is a bitmap with one bit per block of that order, which is set if the whole block is free.
+// A free frame is part of exactly one free block. When a block is freed, it is merged with its
+// buddy for as long as the buddy is free too. When a block is allocated, a larger one is split if
+// required, and the halves we don't need are marked free at their orders.
+//
+// The bitmaps are stored in memory reserved from the managed regions, just like the bitmap
+// manager does. Free frames are not mapped, so we can't keep free lists in the frames themselves.
+
+#include <tmos/klog.h>
+#include <tmos/memory.h>
+#include <tmos/spin.h>
+#include <tmos/ds/bitmap.h>
+#include <string.h>
+
+// Maximum order of blocks. Must be atleast 9 for 2M blocks
+#ifndef BUDDY_MAX_ORDER
+#define BUDDY_MAX_ORDER 10
+#endif
+
+// Number of frames in a block of the given order
+#define __BLK_SZ(o) ((paddr_t) 1 << (o))
+
+// Buddy physical memory manager
+struct buddy_pmmgr {
+	paddr_t base, tot_blk, used_blk, fast_start, fast_end;
+	paddr_t meta, meta_sz;                   // Location and size of the bitmaps
+	struct bitmap free[BUDDY_MAX_ORDER + 1]; // Free blocks, for each order
+	paddr_t nfree[BUDDY_MAX_ORDER + 1];      // Number of free blocks, for each order
+	paddr_t hint[BUDDY_MAX_ORDER + 1];       // No block below this index is free, for each order
+	spin_t lock;
+};
+
+static struct buddy_pmmgr _mgr = { 0 };
+
+// Mark a block of the given order as free
+static inline void _blk_set(paddr_t blk, uint32_t order) {
+	paddr_t idx = blk >> order;
+	ASSERT(!BM_TEST(_mgr.free[order], idx));
+	BM_SET(_mgr.free[order], idx);
+	_mgr.nfree[order]++;
+	if (idx < _mgr.hint[order]) {
+		_mgr.hint[order] = idx;
+	}
+}
+
+// Mark a free block of the given order as not free
+static inline void _blk_unset(paddr_t blk, uint32_t order) {
+	BM_UNSET(_mgr.free[order], blk >> order);
+	_mgr.nfree[order]--;
+}
+
+// Free a block of the given order starting at frame blk, merging it with its buddies
+static void _free_blk(paddr_t blk, uint32_t order) {
+	paddr_t buddy;
+	while (order < BUDDY_MAX_ORDER) {
+		buddy = blk ^ __BLK_SZ(order);
+		if ((buddy >> order) >= _mgr.free[order].num_bits
+				|| !BM_TEST(_mgr.free[order], buddy >> order)) {
+			break;
+		}
+		_blk_unset(buddy, order);
+		blk &= ~__BLK_SZ(order);
+		order++;
+	}
+	_blk_set(blk, order);
+}
+
+// Free the frames in [start, end), as the largest aligned blocks which fit
+static void _free_range(paddr_t start, paddr_t end) {
+	uint32_t order;
+	while (start < end) {
+		order = start ? __builtin_ctzll(start) : BUDDY_MAX_ORDER;
+		if (order > BUDDY_MAX_ORDER) {
+			order = BUDDY_MAX_ORDER;
+		}
+		while (start + __BLK_SZ(order) > end) {
+			order--;
+		}
+		_free_blk(start, order);
+		start += __BLK_SZ(order);
+	}
+}
+
+// Allocate a block of the given order, lying completely within the frames [lo, hi). Returns the
+// first frame of the block, or PADDR_INVALID
+static paddr_t _alloc_blk(paddr_t lo, paddr_t hi, uint32_t order) {
+	paddr_t idx, start, blk = 0, sub = 0;
+	uint32_t o;
+	lo = ROUND_UP(lo, __BLK_SZ(order));
+	if (lo >= hi || hi - lo < __BLK_SZ(order)) {
+		return PADDR_INVALID;
+	}
+	// Find the smallest order with a free block which contains a suitable sub-block
+	for (o = order; o <= BUDDY_MAX_ORDER; o++) {
+		if (!_mgr.nfree[o]) {
+			continue;
+		}
+		start = lo >> o;
+		idx = bm_find_first_set(&_mgr.free[o], start > _mgr.hint[o] ? start : _mgr.hint[o]);
+		if (start <= _mgr.hint[o]) {
+			// Nothing is free between the hint and here
+			_mgr.hint[o] = idx;
+		}
+		for (; idx < _mgr.free[o].num_bits; idx = bm_find_first_set(&_mgr.free[o], idx + 1)) {
+			blk = idx << o;
+			if (blk >= hi) {
+				break;
+			}
+			sub = blk > lo ? blk : lo;
+			if (sub + __BLK_SZ(order) <= blk + __BLK_SZ(o) && sub + __BLK_SZ(order) <= hi) {
+				goto found;
+			}
+		}
+	}
+	return PADDR_INVALID;
+
+found:
+	// Split the block, giving back the halves which don't contain the sub-block
+	_blk_unset(blk, o);
+	while (o > order) {
+		o--;
+		if (sub >= blk + __BLK_SZ(o)) {
+			_blk_set(blk, o);
+			blk += __BLK_SZ(o);
+		} else {
+			_blk_set(blk + __BLK_SZ(o), o);
+		}
+	}
+	return blk;
+}
+
+// Initialize the buddy memory manager
+static void _init(region_t *regions, uint32_t num_regions, paddr_t fast_start, paddr_t fast_end) {
+	paddr_t start, end, sz, meta_end;
+	uint32_t i, o, mreg = 0;
+	void *map;
+	ASSERT(num_regions > 1);
+	// Align base so that blocks of each order are physically aligned
+	_mgr.base = ROUND_DOWN(REGION_START(regions[num_regions - 1]), PAGE_SIZE << BUDDY_MAX_ORDER);
+	_mgr.tot_blk = _mgr.used_blk = (REGION_START(regions[0]) - _mgr.base) >> PAGE_SIZE_SHIFT;
+	_mgr.fast_start = fast_start;
+	_mgr.fast_end = fast_end;
+	_mgr.lock = SPIN_UNLOCKED;
+	// Get size of bitmaps required. Only blocks lying completely within memory are tracked
+	for (o = 0, sz = 0; o <= BUDDY_MAX_ORDER; o++) {
+		sz += ROUND_UP(_mgr.tot_blk >> o, WORD_SIZE) >> 3;
+	}
+	_mgr.meta_sz = PAGE_ALGN_UP(sz);
+	// Find an available region big enough to accomodate the bitmaps. Also mark regions as managed
+	for (i = num_regions - 1; i > 0; i--) {
+		REGION_SET_MANAGED(regions[i]);
+		if (mreg || REGION_TYPE(regions[i]) != REGION_TYPE_AVAIL) {
+			continue;
+		}
+		if (REGION_START(regions[i - 1]) - REGION_START(regions[i]) >= _mgr.meta_sz) {
+			mreg = i;
+		}
+	}
+	if (mreg == 0) {
+		PANIC("No space for buddy bitmaps in provided regions");
+	}
+	// Found
+	_mgr.meta = REGION_START(regions[mreg]);
+	meta_end = _mgr.meta + _mgr.meta_sz;
+#if defined(__TMOS_CFG_ARCH_x86_64__) || defined(__TMOS_CFG_ARCH_x86__)
+	map = (void*) _mgr.meta + KRNL_VBASE;
+#else
+	PANIC("Architecture not handled yet");
+#endif
+	memset(map, 0, _mgr.meta_sz);
+	for (o = 0; o <= BUDDY_MAX_ORDER; o++) {
+		BM_INIT(_mgr.free[o], map, _mgr.tot_blk >> o);
+		map += BM_SZ(_mgr.free[o]);
+		_mgr.nfree[o] = _mgr.hint[o] = 0;
+	}
+	// Go over regions and free available memory, except for the bitmaps
+	for (i = 1; i < num_regions; i++) {
+		if (REGION_TYPE(regions[i]) != REGION_TYPE_AVAIL) {
+			continue;
+		}
+		start = REGION_START(regions[i]);
+		end = REGION_START(regions[i - 1]);
+		if (i == mreg) {
+			start = meta_end;
+		}
+		if (start >= end) {
+			continue;
+		}
+		start = (start - _mgr.base) >> PAGE_SIZE_SHIFT;
+		end = (end - _mgr.base) >> PAGE_SIZE_SHIFT;
+		_free_range(start, end);
+		_mgr.used_blk -= end - start;
+	}
+}
+
+// Allocate num contiguous frames within [above, below), aligned to (1 << align) frames
+static paddr_t _spl_alloc(paddr_t above, paddr_t below, uint32_t align, uint32_t num) {
+	paddr_t lo, hi, blk;
+	uint32_t order;
+	ASSERT(num);
+	// Get the order of a block large enough, and suitably aligned
+	order = num == 1 ? 0 : 64 - __builtin_clzll((uint64_t) num - 1);
+	if (order < align) {
+		order = align;
+	}
+	if (order > BUDDY_MAX_ORDER) {
+		return PADDR_INVALID;
+	}
+	lo = above > _mgr.base ? (PAGE_ALGN_UP(above) - _mgr.base) >> PAGE_SIZE_SHIFT : 0;
+	hi = below > _mgr.base ? (below - _mgr.base) >> PAGE_SIZE_SHIFT : 0;
+	if (hi > _mgr.tot_blk) {
+		hi = _mgr.tot_blk;
+	}
+	spin_lock_intsafe(&_mgr.lock);
+	blk = _alloc_blk(lo, hi, order);
+	if (blk != PADDR_INVALID) {
+		// Give back frames beyond what was asked for
+		_free_range(blk + num, blk + __BLK_SZ(order));
+		_mgr.used_blk += num;
+	}
+	spin_unlock(&_mgr.lock);
+	if (blk == PADDR_INVALID) {
+		return PADDR_INVALID;
+	}
+	return (blk << PAGE_SIZE_SHIFT) + _mgr.base;
+}
+
+// Free num contiguous frames starting at addr
+static void _spl_free(paddr_t addr, uint32_t num) {
+	ASSERT((addr & ~PADDR_ALGN_MASK) == 0);
+	ASSERT(addr >= _mgr.base);
+	addr = (addr - _mgr.base) >> PAGE_SIZE_SHIFT;
+	ASSERT(addr + num <= _mgr.tot_blk);
+	spin_lock_intsafe(&_mgr.lock);
+	_free_range(addr, addr + num);
+	_mgr.used_blk -= num;
+	spin_unlock(&_mgr.lock);
+}
+
+// Allocate one frame (for fast allocator). Frames above ZONE_DMA32 are preferred, so that memory
+// which 32-bit devices can address is only used once the rest runs out
+static paddr_t _alloc() {
+	paddr_t start, end, ret;
+	end = _mgr.base + (_mgr.tot_blk << PAGE_SIZE_SHIFT);
+	if (end > _mgr.fast_end) {
+		end = _mgr.fast_end;
+	}
+	if (end > ZONE_DMA32_END) {
+		start = _mgr.fast_start > ZONE_DMA32_END ? _mgr.fast_start : ZONE_DMA32_END;
+		ret = _spl_alloc(start, end, 0, 1);
+		if (ret != PADDR_INVALID || start == _mgr.fast_start) {
+			return ret;
+		}
+		end = ZONE_DMA32_END;
+	}
+	return _spl_alloc(_mgr.fast_start, end, 0, 1);
+}
+
+// Free one frame (for fast allocator)
+static void _free(paddr_t addr) {
+	ASSERT(addr >= _mgr.fast_start);
+	ASSERT(addr < _mgr.fast_end);
+	_spl_free(addr, 1);
+}
+
+// Remap the space taken by the bitmaps
+#if defined(__TMOS_CFG_ARCH_x86_64__)
+#include <tmos/arch/memory.h>
+
+static void _remap_cb() {
+	vmm_map_to(_mgr.meta + KRNL_VBASE, _mgr.meta, _mgr.meta_sz >> PAGE_SIZE_SHIFT,
+		   PTE_FLG_PRESENT | PTE_FLG_WRITABLE);
+}
+
+#endif
+
+// The memory manager
+struct pmmgr BUDDY_PMMGR = {
+	.init = _init,
+	.alloc = _alloc,
+	.free = _free,
+	.spl_alloc = _spl_alloc,
+	.spl_free = _spl_free,
+#if defined(__TMOS_CFG_ARCH_x86_64__)
+	.remap_cb = _remap_cb,
+#endif
+};
@@ -9,6 +9,16 @@
 //
 // On freeing, we check if adjacent chunks are free. If yes, we merge the chunks and move them to
 // the appropriate list.
+//
+// Requests larger than the biggest bin are served from a separate large object area, as runs of
+// pages mapped straight from the VMM. Their size is kept in a record outside the allocation, and
+// the pages are unmapped on freeing.
+//
+// When built with HEAP_DEBUG, every allocation gets a header and a trailing redzone, freed memory
+// is poisoned, and live allocations are tracked along with their allocation sites.
+//
+// In front of the bins, each CPU keeps a magazine of chunks per bin. Allocations and frees go to
+// the magazine without taking the lock, and only refill from or drain to the bins in batches.
 
 #include <tmos/memory.h>
 #include <tmos/system.h>
@@ -17,13 +27,37 @@
 #include <tmos/spin.h>
 #include <tmos/klog.h>
 #include <tmos/ds/list.h>
+#include <tmos/arch/memory.h>
 
-// TODO: Per-CPU lockless memory pools
+// Number of chunks each CPU caches per bin, and number of chunks moved between a CPU's cache and
+// the shared bins at a time
+#ifndef HEAP_MAG_SIZE
+#define HEAP_MAG_SIZE 16
+#endif
+#ifndef HEAP_MAG_BATCH
+#define HEAP_MAG_BATCH 8
+#endif
+
+// Number of buckets in the request size histogram. Bucket i counts requests in (2^(i-1), 2^i]
+#define HEAP_HIST_BUCKETS 32
+
+// Number of hash buckets for live large allocations
+#define HEAP_LARGE_NUM_BUCKETS 64
+
+// When the last chunk grows beyond the trim threshold, memory beyond the first HEAP_TRIM_KEEP
+// bytes of it is given back with ksbrk
+#ifndef HEAP_TRIM_THRESHOLD
+#define HEAP_TRIM_THRESHOLD (PAGE_SIZE << 4)
+#endif
+#ifndef HEAP_TRIM_KEEP
+#define HEAP_TRIM_KEEP (PAGE_SIZE << 1)
+#endif
 
 // Head of a chunk of memory. In case of a free chunk, it stores size, pointer to next free,
 // pointer to previous free. In case of used chunk, it stores just the size. The LSB of the size
 // field is used to denote if the chunk is used or not. The 2nd LSB is used to denote if the
-// previous chunk is used or not
+// previous chunk is used or not. The 3rd LSB is used to denote if a used chunk is parked in a
+// CPU's magazine
 struct heap_chunk {
 	word_t memsz;
 	struct list list;
@@ -64,6 +98,21 @@ static inline void _chunk_set_prev_free(struct heap_chunk *chunk) {
 	chunk->memsz &= ~(word_t) 2;
 }
 
+// Is a chunk parked in a magazine
+static inline bool _chunk_is_cached(const struct heap_chunk *chunk) {
+	return (chunk->memsz & 4) != 0;
+}
+
+// Denote a chunk as parked in a magazine
+static inline void _chunk_set_cached(struct heap_chunk *chunk) {
+	chunk->memsz |= (word_t) 4;
+}
+
+// Denote a chunk as taken out of a magazine
+static inline void _chunk_set_uncached(struct heap_chunk *chunk) {
+	chunk->memsz &= ~(word_t) 4;
+}
+
 // Get the memory size for the chunk
 static inline word_t _chunk_memsz(const struct heap_chunk *chunk) {
 	return chunk->memsz & ~7;
@@ -104,9 +153,9 @@ static inline word_t _chunk_addr_prev_sz(const struct heap_chunk *chunk) {
 	return _chunk_addr_prev_memsz(chunk) + (WORD_SIZE >> 3);
 }
 
-// Get a pointer to previous chunk in terms of memory address. Only words if previous chunk is free
+// Get a pointer to previous chunk in terms of memory address. Returns NULL if previous chunk is used
 static inline struct heap_chunk* _chunk_addr_prev(struct heap_chunk *chunk) {
-	if (_chunk_is_prev_used(chunk)) {
+	if (!_chunk_is_prev_used(chunk)) {
 		return (struct heap_chunk*) ((void*) chunk - _chunk_addr_prev_sz(chunk));
 	}
 	return NULL;
@@ -118,7 +167,7 @@ static inline struct heap_chunk* _chunk_addr_next(struct heap_chunk *chunk) {
 }
 
 // Split off from the beginning of a chunk. Assumes chunk is free. Pointer points to new beginning
-// of right chunk. Returns pointer to left chunk. Assumes enough space
+// of right chunk. Returns pointer to left chunk. Assumes enough space. The caller handles lists
 static struct heap_chunk* _chunk_split_front(struct heap_chunk **chunk, word_t left_memsz) {
 	struct heap_chunk *left, *right;
 	left = *chunk;
@@ -127,13 +176,12 @@ static struct heap_chunk* _chunk_split_front(struct heap_chunk **chunk, word_t l
 	left->memsz = left_memsz | (left->memsz & 7);
 	_chunk_footer(left)->memsz = left_memsz;
 	_chunk_footer(right)->memsz = _chunk_memsz(right);
-	list_add_front(&left->list, &right->list);
 	*chunk = right;
 	return left;
 }
 
 // Split off from the end of a chunk. Assumes chunk is free. Pointer points to new beginning
-// of left chunk. Returns pointer to right chunk. Assumes enough space
+// of left chunk. Returns pointer to right chunk. Assumes enough space. The caller handles lists
 static struct heap_chunk* _chunk_split_rear(struct heap_chunk *chunk, word_t left_memsz) {
 	struct heap_chunk *left, *right;
 	left = chunk;
@@ -142,7 +190,6 @@ static struct heap_chunk* _chunk_split_rear(struct heap_chunk *chunk, word_t lef
 	left->memsz = left_memsz | (left->memsz & 7);
 	_chunk_footer(left)->memsz = left_memsz;
 	_chunk_footer(right)->memsz = _chunk_memsz(right);
-	list_add_front(&left->list, &right->list);
 	return right;
 }
 
@@ -231,76 +278,579 @@ static struct heap_bin _bins[HEAP_NUM_BINS] = {
 #define BIN_MIN_SIZE 24
 #endif
 
-// Get the mininmum bin size for a given request size
-static word_t _get_size(size_t req) {
-	if (req <= BIN_MIN_SIZE) {
-		return BIN_MIN_SIZE;
-	}
-	// TODO: Handle requests larger than 3840 bytes
+// Get the bin size for a request size, as a constant expression
+#define __BIN_SZ(r)                           \
+	((r) <= BIN_MIN_SIZE ? BIN_MIN_SIZE : \
+	 (r) <= INC8_END ? ROUND_UP(r, 8) :   \
+	 (r) <= INC16_END ? ROUND_UP(r, 16) : \
+	 (r) <= INC32_END ? ROUND_UP(r, 32) : \
+	 (r) <= INC64_END ? ROUND_UP(r, 64) : \
+	 (r) <= INC128_END ? ROUND_UP(r, 128) : ROUND_UP(r, 256))
+
+// Get the bin index for a bin size, as a constant expression
+#define __BIN_IDX(sz)                                          \
+	((sz) <= INC8_END ? ((sz) >> 3) - 2 :                  \
+	 (sz) <= INC16_END ? 14 + (((sz) - INC8_END) >> 4) :   \
+	 (sz) <= INC32_END ? 22 + (((sz) - INC16_END) >> 5) :  \
+	 (sz) <= INC64_END ? 30 + (((sz) - INC32_END) >> 6) :  \
+	 (sz) <= INC128_END ? 38 + (((sz) - INC64_END) >> 7) : \
+	 46 + (((sz) - INC128_END) >> 8))
+
+// Generate table entries for request sizes (i << 3) onwards
+#define __SC1(i)   __BIN_IDX(__BIN_SZ((i) << 3)),
+#define __SC2(i)   __SC1(i) __SC1((i) + 1)
+#define __SC4(i)   __SC2(i) __SC2((i) + 2)
+#define __SC8(i)   __SC4(i) __SC4((i) + 4)
+#define __SC16(i)  __SC8(i) __SC8((i) + 8)
+#define __SC32(i)  __SC16(i) __SC16((i) + 16)
+#define __SC64(i)  __SC32(i) __SC32((i) + 32)
+#define __SC128(i) __SC64(i) __SC64((i) + 64)
+#define __SC256(i) __SC128(i) __SC128((i) + 128)
+
+// Bin index for every request size up to INC256_END, indexed by the size in words of 8 bytes,
+// rounded up
+static const uint8_t _size_class[(INC256_END >> 3) + 1] = {
+	__SC256(0) __SC128(256) __SC64(384) __SC32(448) __SC1(480)
+};
+
+// In debug mode, the allocator proper is wrapped by functions which check and track allocations.
+// Otherwise, the allocator proper is the public interface
+#ifdef HEAP_DEBUG
+static void* __kmalloc(size_t size);
+static void* __kmalloc_aligned(size_t size, size_t align);
+static void* __krealloc(void *ptr, size_t size) __attribute__((unused));
+static void __kfree(void *ptr);
+#else
+#define __kmalloc kmalloc
+#define __kmalloc_aligned kmalloc_aligned
+#define __krealloc krealloc
+#define __kfree kfree
+#endif
+
+// Get bin index for given request size
+static inline size_t _get_bin_idx(size_t req) {
 	ASSERT(req <= INC256_END);
-	if (req <= INC8_END) {
-		return ROUND_UP(req, 8);
+	return _size_class[(req + 7) >> 3];
+}
+
+// Get bin index for a free chunk. Chunks are put in the largest bin whose size they can serve.
+// Chunks larger than the biggest bin all go to the last bin
+static inline size_t _get_free_bin_idx(word_t memsz) {
+	size_t bindx;
+	if (memsz > INC256_END) {
+		return HEAP_NUM_BINS - 1;
 	}
-	if (req <= INC16_END) {
-		return ROUND_UP(req, 16);
+	bindx = _size_class[memsz >> 3];
+	if (_bins[bindx].memsz > memsz) {
+		bindx--;
 	}
-	if (req <= INC32_END) {
-		return ROUND_UP(req, 32);
+	return bindx;
+}
+
+// Store global heap state
+static struct {
+	struct heap_chunk *last;
+	size_t free;       // Bytes in free chunks in bins
+	uint64_t nonempty; // Bitmap of bins which have free chunks
+} _heap;
+
+// The bitmap of non-empty bins has a bit per bin
+STATIC_ASSERT_FILE(HEAP_NUM_BINS <= WORD_SIZE);
+
+// Lock for the bins and the last chunk
+static spin_t _lock = SPIN_UNLOCKED;
+
+// Per-CPU magazine of chunks for one bin. Chunks in a magazine are still marked as used in the
+// shared heap, so a CPU can hand them out and take them back without taking the lock. They are
+// tagged as cached instead, so that freeing them again is caught
+struct heap_mag {
+	word_t num;
+	struct heap_chunk *chunks[HEAP_MAG_SIZE];
+};
+
+// Per-CPU allocation counters, per bin. The last entry counts large allocations
+struct heap_cpu_stats {
+	uint64_t allocs[HEAP_NUM_BINS + 1];
+	uint64_t frees[HEAP_NUM_BINS + 1];
+	uint64_t hist[HEAP_HIST_BUCKETS];
+};
+
+// Per-CPU cache of magazines, and counters. Aligned so that no two CPUs share a cache line
+struct heap_cpu_cache {
+	struct heap_mag mags[HEAP_NUM_BINS];
+	struct heap_cpu_stats stats;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+static struct heap_cpu_cache _cpu_cache[__TMOS_CFG_NUM_CPUS__];
+
+// High-water mark of live allocations per bin, sampled on the slow paths
+static uint64_t _hwm[HEAP_NUM_BINS + 1];
+
+// Get histogram bucket for a request size
+static inline size_t _hist_idx(size_t size) {
+	size_t idx;
+	if (size <= 1) {
+		return 0;
 	}
-	if (req <= INC64_END) {
-		return ROUND_UP(req, 64);
+	idx = WORD_SIZE - __builtin_clzll(size - 1);
+	return idx < HEAP_HIST_BUCKETS ? idx : HEAP_HIST_BUCKETS - 1;
+}
+
+// Get number of live allocations in a bin, summed over all CPUs
+static uint64_t _stats_live(size_t bindx) {
+	uint64_t allocs = 0, frees = 0;
+	size_t i;
+	for (i = 0; i < __TMOS_CFG_NUM_CPUS__; i++) {
+		allocs += _cpu_cache[i].stats.allocs[bindx];
+		frees += _cpu_cache[i].stats.frees[bindx];
 	}
-	if (req <= INC128_END) {
-		return ROUND_UP(req, 128);
+	return allocs - frees;
+}
+
+// Update the high-water mark for a bin
+static void _stats_sample(size_t bindx) {
+	uint64_t live = _stats_live(bindx);
+	if (live > _hwm[bindx]) {
+		_hwm[bindx] = live;
 	}
-	if (req <= INC256_END) {
-		return ROUND_UP(req, 256);
+}
+
+// Get current end of heap
+static void* _heap_cur_end() {
+	return (void*) _heap.last + (WORD_SIZE >> 3) + _heap.last->memsz;
+}
+
+// Add a free chunk to its bin. Must be called with the lock held
+static void _heap_bin_add(struct heap_chunk *chunk) {
+	size_t bindx;
+	bindx = _get_free_bin_idx(_chunk_memsz(chunk));
+	_chunk_footer(chunk)->memsz = _chunk_memsz(chunk);
+	list_add_front(&_bins[bindx].head.list, &chunk->list);
+	_heap.nonempty |= (uint64_t) 1 << bindx;
+	_heap.free += _chunk_memsz(chunk);
+}
+
+// Remove a free chunk from its bin. Must be called with the lock held
+static void _heap_bin_del(struct heap_chunk *chunk) {
+	size_t bindx;
+	bindx = _get_free_bin_idx(_chunk_memsz(chunk));
+	list_del(&chunk->list);
+	if (list_is_empty(&_bins[bindx].head.list)) {
+		_heap.nonempty &= ~((uint64_t) 1 << bindx);
 	}
-	PANIC("unreachable");
+	_heap.free -= _chunk_memsz(chunk);
 }
 
-// Get bin index for given request size
-static size_t _get_bin_idx(size_t binsz) {
-	size_t base = 0;
-	if (binsz <= INC8_END) {
-		return (binsz >> 3) - 1;
+// If the last chunk has grown beyond the threshold, give memory back. Must be called with the
+// lock held
+static void _heap_trim() {
+	word_t excess;
+	if (_chunk_memsz(_heap.last) <= HEAP_TRIM_THRESHOLD) {
+		return;
 	}
-	base = (INC8_END >> 3) - 1;
-	if (binsz <= INC16_END) {
-		return base + ((binsz - INC8_END) >> 4);
+	excess = PAGE_ALGN_DOWN(_chunk_memsz(_heap.last) - HEAP_TRIM_KEEP);
+	ksbrk(-(intptr_t) excess);
+	_heap.last->memsz -= excess;
+}
+
+// Break off a chunk of the given memory size from the last chunk. Must be called with the lock held
+static struct heap_chunk* _heap_take_last(word_t memsz) {
+	struct heap_chunk *chunk;
+	word_t grow;
+	// Check if it is big enough
+	if (_chunk_memsz(_heap.last) < memsz + PAGE_SIZE) {
+		// Need to push chunk back
+		grow = PAGE_ALGN_UP(memsz + PAGE_SIZE - _chunk_memsz(_heap.last));
+		ksbrk(grow);
+		_heap.last->memsz += grow;
 	}
-	base += (INC16_END - INC8_END) >> 4;
-	if (binsz <= INC32_END) {
-		return base + ((binsz - INC16_END) >> 5);
+	// Enough space in last chunk. Break off
+	chunk = _chunk_split_front(&_heap.last, memsz);
+	_chunk_set_used(chunk);
+	_chunk_set_prev_used(_heap.last);
+	list_init(&_heap.last->list);
+	return chunk;
+}
+
+// Take a chunk for the given bin from the shared heap. Use the smallest non-empty bin which can
+// serve the request. If there is none, break off from the last chunk. Must be called with the lock
+// held
+static struct heap_chunk* _heap_take(size_t bindx) {
+	struct heap_chunk *chunk, *rest;
+	uint64_t mask;
+	// Check if this or a larger bin has free nodes. If yes, allocate
+	mask = _heap.nonempty & (WORD_MAX << bindx);
+	if (mask) {
+		// First chunk in the smallest such bin
+		chunk = _chunk_list_next(&_bins[__builtin_ctzll(mask)].head);
+		_heap_bin_del(chunk);
+		// Chunk can be larger than the bin size. Put back what we don't need
+		if (_chunk_memsz(chunk) >= _bins[bindx].memsz + (WORD_SIZE >> 3) + BIN_MIN_SIZE) {
+			rest = _chunk_split_rear(chunk, _bins[bindx].memsz);
+			_chunk_set_prev_used(rest);
+			_heap_bin_add(rest);
+		} else {
+			_chunk_set_prev_used(_chunk_addr_next(chunk));
+		}
+		_chunk_set_used(chunk);
+		return chunk;
 	}
-	base += (INC32_END - INC16_END) >> 5;
-	if (binsz <= INC64_END) {
-		return base + ((binsz - INC32_END) >> 6);
+	// No free nodes. Break off from last chunk
+	return _heap_take_last(_bins[bindx].memsz);
+}
+
+// Return a used chunk to the shared heap, merging it with free neighbours. Must be called with the
+// lock held
+static void _heap_put(struct heap_chunk *chunk) {
+	struct heap_chunk *prev, *next;
+	_chunk_set_free(chunk);
+	// Merge with previous chunk if it is free
+	if ((prev = _chunk_addr_prev(chunk))) {
+		_heap_bin_del(prev);
+		prev->memsz += _chunk_sz(chunk);
+		chunk = prev;
 	}
-	base += (INC64_END - INC32_END) >> 6;
-	if (binsz <= INC128_END) {
-		return base + ((binsz - INC64_END) >> 7);
+	// Merge into the last chunk if we're right before it
+	next = _chunk_addr_next(chunk);
+	if (next == _heap.last) {
+		chunk->memsz += _chunk_sz(next);
+		_heap.last = chunk;
+		list_init(&_heap.last->list);
+		_heap_trim();
+		return;
 	}
-	base += (INC128_END - INC64_END) >> 7;
-	if (binsz <= INC256_END) {
-		return base + ((binsz - INC128_END) >> 8);
+	// Merge with next chunk if it is free
+	if (!_chunk_is_used(next)) {
+		_heap_bin_del(next);
+		chunk->memsz += _chunk_sz(next);
+	} else {
+		_chunk_set_prev_free(next);
 	}
-	// TODO: Handle requests larger than 3840 bytes
-	PANIC("unreachable");
+	_heap_bin_add(chunk);
 }
 
-// Store global heap state
+// Shrink a used chunk to the given memory size, returning the rest to the shared heap if it is big
+// enough to be a chunk. Must be called with the lock held
+static void _heap_shrink(struct heap_chunk *chunk, word_t memsz) {
+	struct heap_chunk *rest;
+	if (_chunk_memsz(chunk) < memsz + (WORD_SIZE >> 3) + BIN_MIN_SIZE) {
+		_chunk_set_prev_used(_chunk_addr_next(chunk));
+		return;
+	}
+	rest = _chunk_split_rear(chunk, memsz);
+	_chunk_set_used(rest);
+	_chunk_set_prev_used(rest);
+	_heap_put(rest);
+}
+
+// Resize a used chunk in place to the given memory size, by shrinking it or growing into the next
+// chunk. Returns false if it couldn't be done. Must be called with the lock held
+static bool _heap_resize(struct heap_chunk *chunk, word_t memsz) {
+	struct heap_chunk *next;
+	word_t extra, lastsz, grow;
+	if (memsz <= _chunk_memsz(chunk)) {
+		_heap_shrink(chunk, memsz);
+		return true;
+	}
+	extra = memsz - _chunk_memsz(chunk);
+	next = _chunk_addr_next(chunk);
+	// Grow into the last chunk, pushing the heap end back if required
+	if (next == _heap.last) {
+		if (_chunk_memsz(_heap.last) < extra + PAGE_SIZE) {
+			grow = PAGE_ALGN_UP(extra + PAGE_SIZE - _chunk_memsz(_heap.last));
+			ksbrk(grow);
+			_heap.last->memsz += grow;
+		}
+		lastsz = _chunk_memsz(_heap.last);
+		_heap.last = (struct heap_chunk*) ((void*) _heap.last + extra);
+		_heap.last->memsz = lastsz - extra;
+		_chunk_set_prev_used(_heap.last);
+		list_init(&_heap.last->list);
+		chunk->memsz += extra;
+		return true;
+	}
+	// Grow into the next chunk if it is free and big enough
+	if (_chunk_is_used(next) || _chunk_sz(next) < extra) {
+		return false;
+	}
+	_heap_bin_del(next);
+	chunk->memsz += _chunk_sz(next);
+	_heap_shrink(chunk, memsz);
+	return true;
+}
+
+// Refill an empty magazine with a batch of chunks from the shared heap
+static void _mag_refill(struct heap_mag *mag, size_t bindx) {
+	spin_lock(&_lock);
+	_stats_sample(bindx);
+	while (mag->num < HEAP_MAG_BATCH) {
+		mag->chunks[mag->num] = _heap_take(bindx);
+		_chunk_set_cached(mag->chunks[mag->num++]);
+	}
+	spin_unlock(&_lock);
+}
+
+// Drain a batch of chunks from a full magazine back into the shared heap
+static void _mag_drain(struct heap_mag *mag) {
+	word_t i;
+	spin_lock(&_lock);
+	for (i = 0; i < HEAP_MAG_BATCH; i++) {
+		_chunk_set_uncached(mag->chunks[--mag->num]);
+		_heap_put(mag->chunks[mag->num]);
+	}
+	spin_unlock(&_lock);
+}
+
+// Take a chunk of a bin from a CPU's magazine, refilling it if empty. Must be called with
+// interrupts disabled
+static struct heap_chunk* _mag_take(struct heap_cpu_cache *cache, size_t bindx) {
+	struct heap_mag *mag = &cache->mags[bindx];
+	if (!mag->num) {
+		_mag_refill(mag, bindx);
+	}
+	_chunk_set_uncached(mag->chunks[--mag->num]);
+	return mag->chunks[mag->num];
+}
+
+// Put a chunk in a CPU's magazine for the bin it is freed to, draining a batch if it is full. Must
+// be called with interrupts disabled
+static void _mag_put(struct heap_cpu_cache *cache, struct heap_chunk *chunk, size_t bindx) {
+	struct heap_mag *mag = &cache->mags[bindx];
+	if (mag->num == HEAP_MAG_SIZE) {
+		_mag_drain(mag);
+	}
+	_chunk_set_cached(chunk);
+	mag->chunks[mag->num++] = chunk;
+}
+
+// A run of pages in the large object area. Describes either a live allocation or a free range
+struct heap_large {
+	struct list list;
+	vaddr_t start;
+	uint64_t npages;
+};
+
+// State of the large object area
 static struct {
-	struct heap_chunk *last;
-} _heap;
+	vaddr_t brk;                                   // End of used part of the area
+	struct list free;                              // Free ranges, sorted by address
+	struct list live[HEAP_LARGE_NUM_BUCKETS];      // Live allocations, hashed by address
+	spin_t lock;
+} _large;
 
-// Get current end of heap
-static void* _heap_cur_end() {
-	return (void*) _heap.last + (WORD_SIZE >> 3) + _heap.last->memsz;
+// Get hash bucket for a live large allocation
+static inline struct list* _large_bucket(vaddr_t start) {
+	return &_large.live[(start >> PAGE_SIZE_SHIFT) % HEAP_LARGE_NUM_BUCKETS];
+}
+
+// Get large object record from list pointer
+static inline struct heap_large* _large_from_list(struct list *list) {
+	return container_of(list, struct heap_large, list);
+}
+
+// Allocate a record for the large object area. Records are heap metadata, so they are taken from
+// this CPU's magazine directly, and not counted in the statistics
+static struct heap_large* _large_rec_alloc() {
+	struct heap_chunk *chunk;
+	bool intr;
+	intr = sys_int_enabled();
+	sys_disable_int();
+	chunk = _mag_take(&_cpu_cache[cpu_get_id()], _get_bin_idx(sizeof(struct heap_large)));
+	if (intr) {
+		sys_enable_int();
+	}
+	return (struct heap_large*) ((void*) chunk + (WORD_SIZE >> 3));
+}
+
+// Free a record of the large object area
+static void _large_rec_free(struct heap_large *rec) {
+	struct heap_chunk *chunk;
+	bool intr;
+	chunk = (struct heap_chunk*) ((void*) rec - (WORD_SIZE >> 3));
+	intr = sys_int_enabled();
+	sys_disable_int();
+	_mag_put(&_cpu_cache[cpu_get_id()], chunk, _get_free_bin_idx(_chunk_memsz(chunk)));
+	if (intr) {
+		sys_enable_int();
+	}
+}
+
+// Find the record of a live large allocation. Must be called with the large area lock held
+static struct heap_large* _large_find(vaddr_t start) {
+	struct list *node, *bucket;
+	bucket = _large_bucket(start);
+	for (node = bucket->next; node != bucket; node = node->next) {
+		if (_large_from_list(node)->start == start) {
+			return _large_from_list(node);
+		}
+	}
+	PANIC("Attempt to free unallocated memory\n");
+}
+
+// Put a range described by the given record in the free list, merging with neighbours, and give
+// it back if it is at the end of the used area. Must be called with the large area lock held
+static void _large_release(struct heap_large *rec) {
+	struct heap_large *cur, *prev = NULL, *next = NULL;
+	struct list *node;
+	// Find free neighbours in the address-sorted free list
+	for (node = _large.free.next; node != &_large.free; node = node->next) {
+		cur = _large_from_list(node);
+		if (cur->start > rec->start) {
+			next = cur;
+			break;
+		}
+		prev = cur;
+	}
+	// Merge with neighbours
+	if (prev && prev->start + (prev->npages << PAGE_SIZE_SHIFT) == rec->start) {
+		prev->npages += rec->npages;
+		_large_rec_free(rec);
+		rec = prev;
+	} else {
+		list_add_tail(next ? &next->list : &_large.free, &rec->list);
+	}
+	if (next && rec->start + (rec->npages << PAGE_SIZE_SHIFT) == next->start) {
+		rec->npages += next->npages;
+		list_del(&next->list);
+		_large_rec_free(next);
+	}
+	// If the range is at the end of the used part, give it back
+	if (rec->start + (rec->npages << PAGE_SIZE_SHIFT) == _large.brk) {
+		_large.brk = rec->start;
+		list_del(&rec->list);
+		_large_rec_free(rec);
+	}
+}
+
+// Allocate a run of pages from the large object area. Counted in the statistics as a large
+// allocation
+static void* _large_alloc(size_t size) {
+	struct heap_large *rec, *cur;
+	struct list *node;
+	uint64_t npages;
+	npages = PAGE_ALGN_UP(size) >> PAGE_SIZE_SHIFT;
+	// Allocate the record before locking, since it comes from the bins
+	rec = _large_rec_alloc();
+	rec->npages = npages;
+	spin_lock_intsafe(&_large.lock);
+	// First fit among free ranges
+	for (node = _large.free.next; node != &_large.free; node = node->next) {
+		cur = _large_from_list(node);
+		if (cur->npages < npages) {
+			continue;
+		}
+		rec->start = cur->start;
+		cur->start += npages << PAGE_SIZE_SHIFT;
+		cur->npages -= npages;
+		if (!cur->npages) {
+			list_del(&cur->list);
+		} else {
+			cur = NULL;
+		}
+		break;
+	}
+	if (node == &_large.free) {
+		// No free range big enough. Extend the used part
+		cur = NULL;
+		ASSERT(_large.brk + (npages << PAGE_SIZE_SHIFT) <= KRNL_LHEAP_END);
+		rec->start = _large.brk;
+		_large.brk += npages << PAGE_SIZE_SHIFT;
+	}
+	vmm_map(rec->start, npages, PTE_FLG_WRITABLE);
+	list_add_front(_large_bucket(rec->start), &rec->list);
+	_cpu_cache[cpu_get_id()].stats.allocs[HEAP_NUM_BINS]++;
+	_stats_sample(HEAP_NUM_BINS);
+	spin_unlock(&_large.lock);
+	// Free the record of a range we used up completely
+	if (cur) {
+		_large_rec_free(cur);
+	}
+	return (void*) rec->start;
+}
+
+// Free a run of pages in the large object area
+static void _large_free(void *ptr) {
+	struct heap_large *rec;
+	ASSERT(IS_ALIGNED((vaddr_t) ptr, PAGE_SIZE));
+	spin_lock_intsafe(&_large.lock);
+	rec = _large_find((vaddr_t) ptr);
+	list_del(&rec->list);
+	vmm_free(rec->start, rec->npages);
+	_large_release(rec);
+	_cpu_cache[cpu_get_id()].stats.frees[HEAP_NUM_BINS]++;
+	spin_unlock(&_large.lock);
+}
+
+// Resize a large allocation in place if possible. Returns false if it couldn't be done. Stores the
+// previous size of the allocation in oldsz
+static bool _large_resize(void *ptr, size_t size, size_t *oldsz) {
+	struct heap_large *rec, *cur, *tail;
+	struct list *node;
+	vaddr_t end;
+	uint64_t npages, extra;
+	ASSERT(IS_ALIGNED((vaddr_t) ptr, PAGE_SIZE));
+	npages = PAGE_ALGN_UP(size) >> PAGE_SIZE_SHIFT;
+	spin_lock_intsafe(&_large.lock);
+	rec = _large_find((vaddr_t) ptr);
+	*oldsz = rec->npages << PAGE_SIZE_SHIFT;
+	end = rec->start + (rec->npages << PAGE_SIZE_SHIFT);
+	// Shrink. Unmap the tail and release it
+	if (npages <= rec->npages) {
+		if (npages < rec->npages) {
+			tail = _large_rec_alloc();
+			tail->npages = rec->npages - npages;
+			tail->start = rec->start + (npages << PAGE_SIZE_SHIFT);
+			rec->npages = npages;
+			vmm_free(tail->start, tail->npages);
+			_large_release(tail);
+		}
+		spin_unlock(&_large.lock);
+		return true;
+	}
+	extra = npages - rec->npages;
+	// Grow at the end of the used area
+	if (end == _large.brk) {
+		ASSERT(_large.brk + (extra << PAGE_SIZE_SHIFT) <= KRNL_LHEAP_END);
+		_large.brk += extra << PAGE_SIZE_SHIFT;
+		vmm_map(end, extra, PTE_FLG_WRITABLE);
+		rec->npages = npages;
+		spin_unlock(&_large.lock);
+		return true;
+	}
+	// Grow into a free range right after us
+	for (node = _large.free.next; node != &_large.free; node = node->next) {
+		cur = _large_from_list(node);
+		if (cur->start < end) {
+			continue;
+		}
+		if (cur->start > end || cur->npages < extra) {
+			break;
+		}
+		vmm_map(end, extra, PTE_FLG_WRITABLE);
+		rec->npages = npages;
+		cur->start += extra << PAGE_SIZE_SHIFT;
+		cur->npages -= extra;
+		if (!cur->npages) {
+			list_del(&cur->list);
+			_large_rec_free(cur);
+		}
+		spin_unlock(&_large.lock);
+		return true;
+	}
+	spin_unlock(&_large.lock);
+	return false;
 }
 
 // Initialize the kernel heap
 void heap_init() {
+	size_t i;
+	// Initialize large object area
+	_large.brk = KRNL_LHEAP_START;
+	list_init(&_large.free);
+	for (i = 0; i < HEAP_LARGE_NUM_BUCKETS; i++) {
+		list_init(&_large.live[i]);
+	}
+	_large.lock = SPIN_UNLOCKED;
 	// We know brk is initially at the beginning of the heap. So allocate one page
 	_heap.last = (struct heap_chunk*) ksbrk(PAGE_SIZE << 1);
 	_heap.last->memsz = (PAGE_SIZE << 1) - (WORD_SIZE >> 3);
@@ -309,66 +859,482 @@ void heap_init() {
 	list_init(&_heap.last->list);
 }
 
+// Get heap fragmentation information
+void heap_get_frag(struct heap_frag *frag) {
+	size_t i;
+	struct list *node;
+	struct heap_chunk *chunk;
+	ASSERT(frag);
+	spin_lock_intsafe(&_lock);
+	frag->free = _heap.free;
+	frag->top = _chunk_memsz(_heap.last);
+	frag->largest = 0;
+	// The largest chunk is in the highest non-empty bin
+	if (_heap.nonempty) {
+		i = WORD_SIZE - 1 - __builtin_clzll(_heap.nonempty);
+		for (node = _bins[i].head.list.next; node != &_bins[i].head.list; node = node->next) {
+			chunk = container_of(node, struct heap_chunk, list);
+			if (_chunk_memsz(chunk) > frag->largest) {
+				frag->largest = _chunk_memsz(chunk);
+			}
+		}
+	}
+	spin_unlock(&_lock);
+}
+
 // Allocate a block of memory of the given size
-void* kmalloc(size_t size) {
+void* __kmalloc(size_t size) {
 	size_t bindx;
+	struct heap_cpu_cache *cache;
 	struct heap_chunk *chunk;
+	bool intr;
 	// 0-size malloc
 	if (!size) {
 		return NULL;
 	}
-	// Get bin index for size. TODO: Handle larger requests
-	bindx = _get_bin_idx(_get_size(size));
-	// Check if bin has free nodes. If yes, allocate
-	if (!list_is_empty(&_bins[bindx].head.list)) {
-		// First chunk in list
-		chunk = _chunk_list_next(&_bins[bindx].head);
-		_chunk_set_used(chunk);
-		if (chunk->list.next != &_bins[bindx].head.list) {
-			_chunk_set_prev_used(_chunk_addr_next(chunk));
+	// Work on this CPU's cache. Interrupts are disabled so that we're not interrupted halfway
+	// through modifying it
+	intr = sys_int_enabled();
+	sys_disable_int();
+	cache = &_cpu_cache[cpu_get_id()];
+	cache->stats.hist[_hist_idx(size)]++;
+	// Larger than the largest bin. Map pages directly
+	if (size > INC256_END) {
+		if (intr) {
+			sys_enable_int();
 		}
-		list_del(&chunk->list);
-		return (void*) chunk + (WORD_SIZE >> 3);
+		return _large_alloc(size);
 	}
-	// No free nodes. Break off from last chunk. Check if it is big enough
-	if (_chunk_memsz(_heap.last) - _bins[bindx].memsz < PAGE_SIZE) {
-		// Need to push chunk back. TODO: Handle larger requests
-		ksbrk(PAGE_SIZE);
-		_heap.last->memsz += PAGE_SIZE;
+	// Get bin index for size, and allocate from this CPU's magazine
+	bindx = _get_bin_idx(size);
+	chunk = _mag_take(cache, bindx);
+	// Count by the bin the chunk will be freed to
+	cache->stats.allocs[_get_free_bin_idx(_chunk_memsz(chunk))]++;
+	if (intr) {
+		sys_enable_int();
 	}
-	// Enough space in last chunk. Break off
-	chunk = _chunk_split_front(&_heap.last, _bins[bindx].memsz);
-	_chunk_set_used(chunk);
 	return (void*) chunk + (WORD_SIZE >> 3);
 }
 
+// Get allocation statistics for a size class. Classes are numbered from 0, and the last class is
+// for large allocations. Returns false if there is no such class
+bool heap_get_class_stats(size_t class, struct heap_class_stats *stats) {
+	size_t i;
+	ASSERT(stats);
+	if (class > HEAP_NUM_BINS) {
+		return false;
+	}
+	stats->size = class < HEAP_NUM_BINS ? _bins[class].memsz : 0;
+	stats->allocs = stats->frees = 0;
+	for (i = 0; i < __TMOS_CFG_NUM_CPUS__; i++) {
+		stats->allocs += _cpu_cache[i].stats.allocs[class];
+		stats->frees += _cpu_cache[i].stats.frees[class];
+	}
+	stats->live = stats->allocs - stats->frees;
+	stats->hwm = stats->live > _hwm[class] ? stats->live : _hwm[class];
+	return true;
+}
+
+// Get number of requests with size in (2^(bucket-1), 2^bucket]. The last bucket also counts all
+// larger requests
+uint64_t heap_get_hist(size_t bucket) {
+	uint64_t ret = 0;
+	size_t i;
+	ASSERT(bucket < HEAP_HIST_BUCKETS);
+	for (i = 0; i < __TMOS_CFG_NUM_CPUS__; i++) {
+		ret += _cpu_cache[i].stats.hist[bucket];
+	}
+	return ret;
+}
+
+// Dump heap statistics over klog
+void heap_dump_stats() {
+	struct heap_class_stats stats;
+	struct heap_frag frag;
+	size_t i;
+	uint64_t n;
+	heap_get_frag(&frag);
+	klog("HEAP: free: %llu, largest free: %llu, top: %llu\n", frag.free, frag.largest, frag.top);
+	klog("HEAP CLASSES:\n");
+	for (i = 0; heap_get_class_stats(i, &stats); i++) {
+		if (!stats.allocs) {
+			continue;
+		}
+		if (stats.size) {
+			klog("  %4llu: ", stats.size);
+		} else {
+			klog("  large: ");
+		}
+		klog("allocs: %llu, frees: %llu, live: %llu, hwm: %llu\n",
+		     stats.allocs, stats.frees, stats.live, stats.hwm);
+	}
+	klog("HEAP REQUEST SIZES:\n");
+	for (i = 0; i < HEAP_HIST_BUCKETS; i++) {
+		if ((n = heap_get_hist(i))) {
+			klog("  <= %llu: %llu\n", (uint64_t) 1 << i, n);
+		}
+	}
+}
+
+// Allocate n pages of memory, aligned to a page boundary
+void* kmalloc_pages(uint64_t n) {
+	ASSERT(n);
+	return _large_alloc(n << PAGE_SIZE_SHIFT);
+}
+
+// Free memory allocated with kmalloc_pages
+void kfree_pages(void *ptr) {
+	ASSERT((uintptr_t) ptr >= KRNL_LHEAP_START && (uintptr_t) ptr < KRNL_LHEAP_END);
+	_large_free(ptr);
+}
+
+// Allocate a block of memory of the given size, aligned to the given power of 2
+void* __kmalloc_aligned(size_t size, size_t align) {
+	struct heap_chunk *chunk, *front;
+	struct heap_cpu_cache *cache;
+	word_t memsz, total;
+	vaddr_t ptr;
+	ASSERT(!(align & (align - 1)));
+	ASSERT(align <= PAGE_SIZE);
+	// Chunks are always word-aligned, and large allocations are page-aligned
+	if (align <= (WORD_SIZE >> 3) || size > INC256_END) {
+		return __kmalloc(size);
+	}
+	if (!size) {
+		return NULL;
+	}
+	// Get a chunk with enough slack in front to split off an aligned chunk
+	memsz = _bins[_get_bin_idx(size)].memsz;
+	total = memsz + align + BIN_MIN_SIZE;
+	spin_lock_intsafe(&_lock);
+	if (total <= INC256_END) {
+		chunk = _heap_take(_get_bin_idx(total));
+	} else {
+		chunk = _heap_take_last(total);
+	}
+	// Split off the slack in front as a free chunk. It needs to be big enough to be a chunk
+	ptr = (vaddr_t) chunk + (WORD_SIZE >> 3);
+	if (!IS_ALIGNED(ptr, align)) {
+		ptr = ROUND_UP(ptr + (WORD_SIZE >> 3) + BIN_MIN_SIZE, align);
+		front = _chunk_split_front(&chunk, ptr - (vaddr_t) chunk - ((WORD_SIZE >> 3) << 1));
+		_chunk_set_used(chunk);
+		_heap_put(front);
+	}
+	// Give back the slack at the end
+	_heap_shrink(chunk, memsz);
+	// Count by the bin the chunk will be freed to. Interrupts are disabled while the lock is held
+	cache = &_cpu_cache[cpu_get_id()];
+	cache->stats.hist[_hist_idx(size)]++;
+	cache->stats.allocs[_get_free_bin_idx(_chunk_memsz(chunk))]++;
+	spin_unlock(&_lock);
+	return (void*) chunk + (WORD_SIZE >> 3);
+}
+
+// Reallocate a block of memory to be of the given size, and copy the contents. Resize in place if
+// possible
+void* __krealloc(void *ptr, size_t size) {
+	struct heap_chunk *chunk;
+	struct heap_cpu_cache *cache;
+	void *ret;
+	size_t oldsz, oldbin, bindx;
+	bool done;
+	if (!ptr) {
+		return __kmalloc(size);
+	}
+	if (!size) {
+		__kfree(ptr);
+		return NULL;
+	}
+	// Large allocation
+	if ((uintptr_t) ptr >= KRNL_LHEAP_START && (uintptr_t) ptr < KRNL_LHEAP_END) {
+		if (size > INC256_END && _large_resize(ptr, size, &oldsz)) {
+			return ptr;
+		}
+		// Either moving to a small chunk, or couldn't grow in place
+		ret = __kmalloc(size);
+		memcpy(ret, ptr, size > INC256_END ? oldsz : size);
+		__kfree(ptr);
+		return ret;
+	}
+	ASSERT((uintptr_t) ptr > KRNL_HEAP_START && ptr < _heap_cur_end());
+	chunk = (struct heap_chunk*) (ptr - (WORD_SIZE >> 3));
+	if (!_chunk_is_used(chunk) || _chunk_is_cached(chunk)) {
+		PANIC("Attempt to realloc unallocated memory\n");
+	}
+	if (size <= INC256_END) {
+		spin_lock_intsafe(&_lock);
+		oldbin = _get_free_bin_idx(_chunk_memsz(chunk));
+		done = _heap_resize(chunk, _bins[_get_bin_idx(size)].memsz);
+		// If the chunk moved to another class, count it as freed from the old one and allocated
+		// in the new one, so that kfree debits the right class
+		if (done && (bindx = _get_free_bin_idx(_chunk_memsz(chunk))) != oldbin) {
+			cache = &_cpu_cache[cpu_get_id()];
+			cache->stats.frees[oldbin]++;
+			cache->stats.allocs[bindx]++;
+		}
+		spin_unlock(&_lock);
+		if (done) {
+			return ptr;
+		}
+	}
+	// Couldn't resize in place. Allocate, copy and free
+	ret = __kmalloc(size);
+	memcpy(ret, ptr, size < _chunk_memsz(chunk) ? size : _chunk_memsz(chunk));
+	__kfree(ptr);
+	return ret;
+}
+
+// Free allocated memory
+void __kfree(void *ptr) {
+	struct heap_chunk *chunk;
+	struct heap_cpu_cache *cache;
+	size_t bindx;
+	bool intr;
+	// Large allocation
+	if ((uintptr_t) ptr >= KRNL_LHEAP_START && (uintptr_t) ptr < KRNL_LHEAP_END) {
+		_large_free(ptr);
+		return;
+	}
+	ASSERT((uintptr_t) ptr > KRNL_HEAP_START && ptr < _heap_cur_end());
+	chunk = (struct heap_chunk*) (ptr - (WORD_SIZE >> 3));
+	if (!_chunk_is_used(chunk) || _chunk_is_cached(chunk)) {
+		PANIC("Attempt to free unallocated memory\n");
+	}
+	bindx = _get_free_bin_idx(_chunk_memsz(chunk));
+	// Return the chunk to this CPU's magazine. If it is full, drain a batch to the shared bins
+	intr = sys_int_enabled();
+	sys_disable_int();
+	cache = &_cpu_cache[cpu_get_id()];
+	cache->stats.frees[bindx]++;
+	_mag_put(cache, chunk, bindx);
+	if (intr) {
+		sys_enable_int();
+	}
+}
+
+#ifndef HEAP_DEBUG
+
+// Allocate a block of memory of the given size, and zero it out
+void* kcalloc(size_t nmemb, size_t size) {
+	void *ptr;
+	if (!nmemb || !size) {
+		return NULL;
+	}
+	ASSERT(nmemb <= SIZE_MAX / size);
+	ptr = kmalloc(nmemb * size);
+	memset(ptr, 0, nmemb * size);
+	return ptr;
+}
+
+// Allocate a block of memory of the given size, aligned to a cache line
+void* kmalloc_cacheline(size_t size) {
+	return kmalloc_aligned(size, CACHE_LINE_SIZE);
+}
+
+#else
+
+// Bytes of redzone after every allocation
+#define HEAP_DBG_REDZONE 16
+
+// Number of allocation sites we track
+#define HEAP_DBG_NUM_SITES 256
+
+// Poison values for fresh allocations, freed memory and redzones
+#define HEAP_DBG_POISON_ALLOC 0xa5
+#define HEAP_DBG_POISON_FREE  0x6b
+#define HEAP_DBG_POISON_RZ    0xfd
+
+// Magic values for live and freed allocations
+#define HEAP_DBG_MAGIC_LIVE 0xa110ca7eda110ca7
+#define HEAP_DBG_MAGIC_FREE 0xdeadbeefdeadbeef
+
+// Header in front of every allocation. The magic is right before the returned memory, so it also
+// acts as the front redzone
+struct heap_dbg {
+	struct list list; // In list of live allocations
+	void *real;       // Pointer returned by the allocator proper
+	size_t size;      // Requested size
+	void *site;       // Return address of the allocating call
+	word_t magic;
+};
+
+// An allocation site
+struct heap_dbg_site {
+	void *site;
+	uint64_t allocs, live, live_bytes;
+};
+
+// Debug state
+static struct {
+	struct list live;
+	struct heap_dbg_site sites[HEAP_DBG_NUM_SITES];
+	spin_t lock;
+} _dbg = { LIST_INIT(_dbg.live), { { 0 } }, SPIN_UNLOCKED };
+
+// Get the entry for an allocation site, creating it if required. Returns NULL if the table is
+// full. Must be called with the debug lock held
+static struct heap_dbg_site* _dbg_site(void *site) {
+	size_t i, idx;
+	idx = ((uintptr_t) site >> 2) % HEAP_DBG_NUM_SITES;
+	for (i = 0; i < HEAP_DBG_NUM_SITES; i++) {
+		if (_dbg.sites[idx].site == site) {
+			return &_dbg.sites[idx];
+		}
+		if (!_dbg.sites[idx].site) {
+			_dbg.sites[idx].site = site;
+			return &_dbg.sites[idx];
+		}
+		idx = (idx + 1) % HEAP_DBG_NUM_SITES;
+	}
+	return NULL;
+}
+
+// Allocate memory with a debug header and redzone, and track it
+static void* _dbg_alloc(size_t size, size_t align, void *site) {
+	struct heap_dbg *dbg;
+	struct heap_dbg_site *entry;
+	size_t hdrsz;
+	void *real, *ptr;
+	if (!size) {
+		return NULL;
+	}
+	// Keep the returned memory aligned the way the allocator proper would
+	hdrsz = ROUND_UP(sizeof(struct heap_dbg), align > (WORD_SIZE >> 3) ? align : WORD_SIZE >> 3);
+	if (align) {
+		real = __kmalloc_aligned(hdrsz + size + HEAP_DBG_REDZONE, align);
+	} else {
+		real = __kmalloc(hdrsz + size + HEAP_DBG_REDZONE);
+	}
+	ptr = real + hdrsz;
+	dbg = ptr - sizeof(struct heap_dbg);
+	memset(real, HEAP_DBG_POISON_RZ, hdrsz - sizeof(struct heap_dbg));
+	memset(ptr, HEAP_DBG_POISON_ALLOC, size);
+	memset(ptr + size, HEAP_DBG_POISON_RZ, HEAP_DBG_REDZONE);
+	dbg->real = real;
+	dbg->size = size;
+	dbg->site = site;
+	dbg->magic = HEAP_DBG_MAGIC_LIVE;
+	spin_lock_intsafe(&_dbg.lock);
+	list_add_front(&_dbg.live, &dbg->list);
+	if ((entry = _dbg_site(site))) {
+		entry->allocs++;
+		entry->live++;
+		entry->live_bytes += size;
+	}
+	spin_unlock(&_dbg.lock);
+	return ptr;
+}
+
+// Check that a pointer is a live allocation with intact redzones, and return its header
+static struct heap_dbg* _dbg_check(void *ptr) {
+	struct heap_dbg *dbg;
+	size_t i;
+	ASSERT(ptr);
+	dbg = ptr - sizeof(struct heap_dbg);
+	if (dbg->magic == HEAP_DBG_MAGIC_FREE) {
+		PANIC("Double free of %#llx, allocated from %#llx\n", ptr, dbg->site);
+	}
+	if (dbg->magic != HEAP_DBG_MAGIC_LIVE) {
+		PANIC("Free of bad or corrupted pointer %#llx\n", ptr);
+	}
+	for (i = 0; i < HEAP_DBG_REDZONE; i++) {
+		if (((uint8_t*) ptr)[dbg->size + i] != HEAP_DBG_POISON_RZ) {
+			PANIC("Overflow past %#llx (%llu bytes), allocated from %#llx\n",
+			      ptr, dbg->size, dbg->site);
+		}
+	}
+	return dbg;
+}
+
+// Stop tracking an allocation, poison it and free it
+static void _dbg_free(void *ptr) {
+	struct heap_dbg *dbg;
+	struct heap_dbg_site *entry;
+	dbg = _dbg_check(ptr);
+	spin_lock_intsafe(&_dbg.lock);
+	list_del(&dbg->list);
+	if ((entry = _dbg_site(dbg->site))) {
+		entry->live--;
+		entry->live_bytes -= dbg->size;
+	}
+	spin_unlock(&_dbg.lock);
+	dbg->magic = HEAP_DBG_MAGIC_FREE;
+	memset(ptr, HEAP_DBG_POISON_FREE, dbg->size + HEAP_DBG_REDZONE);
+	__kfree(dbg->real);
+}
+
+// Allocate a block of memory of the given size
+void* kmalloc(size_t size) {
+	return _dbg_alloc(size, 0, __builtin_return_address(0));
+}
+
+// Allocate a block of memory of the given size, aligned to the given power of 2
+void* kmalloc_aligned(size_t size, size_t align) {
+	return _dbg_alloc(size, align, __builtin_return_address(0));
+}
+
+// Allocate a block of memory of the given size, aligned to a cache line
+void* kmalloc_cacheline(size_t size) {
+	return _dbg_alloc(size, CACHE_LINE_SIZE, __builtin_return_address(0));
+}
+
 // Allocate a block of memory of the given size, and zero it out
 void* kcalloc(size_t nmemb, size_t size) {
 	void *ptr;
-	size_t binsz;
 	if (!nmemb || !size) {
 		return NULL;
 	}
-	binsz = _get_size(nmemb * size);
-	ptr = kmalloc(binsz);
-	memset(ptr, 0, binsz);
+	ASSERT(nmemb <= SIZE_MAX / size);
+	ptr = _dbg_alloc(nmemb * size, 0, __builtin_return_address(0));
+	memset(ptr, 0, nmemb * size);
 	return ptr;
 }
 
+// Reallocate a block of memory to be of the given size, and copy the contents. Always moves, so
+// that stale pointers to the old block are caught
+void* krealloc(void *ptr, size_t size) {
+	struct heap_dbg *dbg;
+	void *ret;
+	if (!ptr) {
+		return _dbg_alloc(size, 0, __builtin_return_address(0));
+	}
+	if (!size) {
+		_dbg_free(ptr);
+		return NULL;
+	}
+	dbg = _dbg_check(ptr);
+	ret = _dbg_alloc(size, 0, __builtin_return_address(0));
+	memcpy(ret, ptr, size < dbg->size ? size : dbg->size);
+	_dbg_free(ptr);
+	return ret;
+}
+
 // Free allocated memory
 void kfree(void *ptr) {
-	struct heap_chunk *chunk;
-	struct heap_footer *footer;
-	size_t bindx;
-	ASSERT((uintptr_t) ptr > KRNL_HEAP_START && ptr < _heap_cur_end());
-	chunk = (struct heap_chunk*) (ptr - (WORD_SIZE >> 3));
-	if (!_chunk_is_used(chunk)) {
-		PANIC("Attempt to free unallocated memory\n");
+	_dbg_free(ptr);
+}
+
+// Dump live allocations and allocation sites over klog
+void heap_dump_allocs() {
+	struct list *node;
+	struct heap_dbg *dbg;
+	size_t i;
+	spin_lock_intsafe(&_dbg.lock);
+	klog("HEAP LIVE ALLOCATIONS:\n");
+	for (node = _dbg.live.next; node != &_dbg.live; node = node->next) {
+		dbg = container_of(node, struct heap_dbg, list);
+		klog("  %#llx: %llu bytes from %#llx\n", (void*) dbg + sizeof(struct heap_dbg),
+		     dbg->size, dbg->site);
 	}
-	bindx = _get_bin_idx(_chunk_memsz(chunk));
-	// Free the chunk and add to beginning of bin list
-	_chunk_set_free(chunk);
-	footer = _chunk_footer(chunk);
-	footer->memsz = _chunk_memsz(chunk);
-	list_add_front(&_bins[bindx].head.list, &chunk->list);
+	klog("HEAP ALLOCATION SITES:\n");
+	for (i = 0; i < HEAP_DBG_NUM_SITES; i++) {
+		if (!_dbg.sites[i].site) {
+			continue;
+		}
+		klog("  %#llx: %llu allocs, %llu live, %llu bytes live\n", _dbg.sites[i].site,
+		     _dbg.sites[i].allocs, _dbg.sites[i].live, _dbg.sites[i].live_bytes);
+	}
+	spin_unlock(&_dbg.lock);
 }
+
+#endif
@@ -160,6 +160,22 @@ void mmap_split_at(struct mmap *map, uint64_t addr) {
 	PANIC("unreachable");
 }
 
+// Get the end of the highest available region in the memory map
+paddr_t mmap_get_avail_end(const struct mmap *map) {
+	paddr_t top = 0;
+	uint32_t i;
+	ASSERT(map);
+	for (i = 1; i < MMAP_MAX_NUM_ENTRIES; i++) {
+		if (REGION_TYPE(map->r[i]) == REGION_TYPE_AVAIL && REGION_START(map->r[i - 1]) > top) {
+			top = REGION_START(map->r[i - 1]);
+		}
+		if (!REGION_START(map->r[i])) {
+			break;
+		}
+	}
+	return top;
+}
+
 // Print the memory map
 void mmap_print(const struct mmap *map) {
 	uint32_t i;
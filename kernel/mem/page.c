@@ -0,0 +1,54 @@
+// (C) 2018 Srimanta Barua
+//
+// Page descriptor array
+//
+// Every physical frame from address 0 up to the end of available memory has a struct page,
+// indexed by its frame number. The array lives at a fixed virtual address, and is sized from the
+// memory map. Frames outside available regions are marked reserved.
+
+#include <tmos/memory.h>
+#include <tmos/system.h>
+#include <tmos/klog.h>
+#include <tmos/ds/list.h>
+#include <tmos/arch/memory.h>
+
+// Descriptors are kept small, so that two fit in a cache line
+STATIC_ASSERT_FILE(sizeof(struct page) == 32);
+
+// The page descriptor array, and the number of descriptors in it
+struct page *page_array = NULL;
+uint64_t page_array_num = 0;
+
+// Initialize the page descriptor array from the memory map
+void page_init(const struct mmap *map) {
+	uint64_t i, pfn, end, sz;
+	struct page *page;
+	ASSERT(map);
+	ASSERT(!page_array);
+	page_array_num = mmap_get_avail_end(map) >> PAGE_SIZE_SHIFT;
+	sz = PAGE_ALGN_UP(page_array_num * sizeof(struct page));
+	if (sz > KRNL_PAGES_SIZE) {
+		PANIC("Page descriptor array too large: %#llx bytes\n", sz);
+	}
+	vmm_map(KRNL_PAGES_START, sz >> PAGE_SIZE_SHIFT, PTE_FLG_WRITABLE | PTE_FLG_NO_EXEC);
+	page_array = (struct page*) KRNL_PAGES_START;
+	// Regions are continuous, and in decreasing order of start address
+	for (i = 1; i < MMAP_MAX_NUM_ENTRIES; i++) {
+		pfn = REGION_START(map->r[i]) >> PAGE_SIZE_SHIFT;
+		end = REGION_START(map->r[i - 1]) >> PAGE_SIZE_SHIFT;
+		if (end > page_array_num) {
+			end = page_array_num;
+		}
+		for (; pfn < end; pfn++) {
+			page = &page_array[pfn];
+			list_init(&page->list);
+			page->refcount = 0;
+			page->mapcount = 0;
+			page->flags = REGION_TYPE(map->r[i]) == REGION_TYPE_AVAIL ? 0 : PG_RESERVED;
+			page->private = 0;
+		}
+		if (!REGION_START(map->r[i])) {
+			break;
+		}
+	}
+}
@@ -0,0 +1,153 @@
+// (C) 2018 Srimanta Barua
+//
+// Per-CPU free frame caches, which can be put in front of any physical memory manager
+//
+// Each CPU has a stack of free frames, from which single frames are allocated and to which they
+// are freed, with just interrupts disabled. When a stack runs empty it is refilled, and when it
+// fills up it is drained, a batch of frames at a time, from the backend under a global lock. The
+// special allocation functions are passed through to the backend.
+
+#include <tmos/memory.h>
+#include <tmos/system.h>
+#include <tmos/spin.h>
+#include <tmos/klog.h>
+#include <tmos/arch/cpu.h>
+#include <stdbool.h>
+
+// Maximum number of frames in a per-CPU stack
+#ifndef PMM_CACHE_SIZE
+#define PMM_CACHE_SIZE 64
+#endif
+
+// Number of frames moved at a time between a per-CPU stack and the backend
+#ifndef PMM_CACHE_BATCH
+#define PMM_CACHE_BATCH 32
+#endif
+
+// A per-CPU stack of free frames
+struct pmm_cpu_cache {
+	uint32_t num;
+	paddr_t frames[PMM_CACHE_SIZE];
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+static struct pmm_cpu_cache _cpu_cache[__TMOS_CFG_NUM_CPUS__];
+
+// The backend, and the lock protecting it
+static struct pmmgr *_backend = NULL;
+static spin_t _lock = SPIN_UNLOCKED;
+
+// Refill a batch of frames into an empty stack. Called with interrupts disabled
+static void _refill(struct pmm_cpu_cache *cache) {
+	paddr_t frame;
+	spin_lock(&_lock);
+	while (cache->num < PMM_CACHE_BATCH) {
+		if ((frame = _backend->alloc()) == PADDR_INVALID) {
+			break;
+		}
+		cache->frames[cache->num++] = frame;
+	}
+	spin_unlock(&_lock);
+}
+
+// Drain a batch of frames from a full stack. Called with interrupts disabled
+static void _drain(struct pmm_cpu_cache *cache) {
+	uint32_t i;
+	spin_lock(&_lock);
+	for (i = 0; i < PMM_CACHE_BATCH; i++) {
+		_backend->free(cache->frames[--cache->num]);
+	}
+	spin_unlock(&_lock);
+}
+
+// Initialize the backend, and empty the stacks
+static void _init(region_t *regions, uint32_t num_regions, paddr_t fast_start, paddr_t fast_end) {
+	uint32_t i;
+	ASSERT(_backend);
+	_backend->init(regions, num_regions, fast_start, fast_end);
+	for (i = 0; i < __TMOS_CFG_NUM_CPUS__; i++) {
+		_cpu_cache[i].num = 0;
+	}
+}
+
+// Allocate one frame from this CPU's stack
+static paddr_t _alloc() {
+	struct pmm_cpu_cache *cache;
+	paddr_t frame = PADDR_INVALID;
+	bool intr;
+	intr = sys_int_enabled();
+	sys_disable_int();
+	cache = &_cpu_cache[cpu_get_id()];
+	if (!cache->num) {
+		_refill(cache);
+	}
+	if (cache->num) {
+		frame = cache->frames[--cache->num];
+	}
+	if (intr) {
+		sys_enable_int();
+	}
+	return frame;
+}
+
+// Free one frame to this CPU's stack
+static void _free(paddr_t addr) {
+	struct pmm_cpu_cache *cache;
+	bool intr;
+	ASSERT(addr != PADDR_INVALID);
+	intr = sys_int_enabled();
+	sys_disable_int();
+	cache = &_cpu_cache[cpu_get_id()];
+	if (cache->num == PMM_CACHE_SIZE) {
+		_drain(cache);
+	}
+	cache->frames[cache->num++] = addr;
+	if (intr) {
+		sys_enable_int();
+	}
+}
+
+// Pass special allocations through to the backend
+static paddr_t _spl_alloc(paddr_t above, paddr_t below, uint32_t align, uint32_t num) {
+	paddr_t ret;
+	if (!_backend->spl_alloc) {
+		PANIC("Backend does not support special allocations");
+	}
+	spin_lock_intsafe(&_lock);
+	ret = _backend->spl_alloc(above, below, align, num);
+	spin_unlock(&_lock);
+	return ret;
+}
+
+// Pass special frees through to the backend
+static void _spl_free(paddr_t addr, uint32_t num) {
+	if (!_backend->spl_free) {
+		PANIC("Backend does not support special allocations");
+	}
+	spin_lock_intsafe(&_lock);
+	_backend->spl_free(addr, num);
+	spin_unlock(&_lock);
+}
+
+// Remap the backend if it requires it
+static void _remap_cb() {
+	if (_backend->remap_cb) {
+		_backend->remap_cb();
+	}
+}
+
+// Set the backend for the per-CPU frame caches
+void pcpu_pmmgr_set_backend(struct pmmgr *backend) {
+	ASSERT(!_backend);
+	ASSERT(backend && backend->alloc && backend->free);
+	_backend = backend;
+}
+
+// The memory manager
+struct pmmgr PCPU_PMMGR = {
+	.init = _init,
+	.alloc = _alloc,
+	.free = _free,
+	.spl_alloc = _spl_alloc,
+	.spl_free = _spl_free,
+	.remap_cb = _remap_cb,
+};
@@ -0,0 +1,219 @@
+// (C) 2018 Srimanta Barua
+//
+// Slab allocator for fixed-size kernel objects.
+//
+// Each cache holds a number of one-page slabs. A slab starts with a header, followed by an array of
+// free-list indices, and then the objects. Since slabs are page-aligned, the slab for an object is
+// found by rounding its address down. The free list is kept outside the objects, so that objects
+// retain the state set up by the constructor while they are free.
+//
+// Slabs have some space left over after the objects. We shift the start of objects in successive
+// slabs by a cache line (colouring), so that objects in different slabs don't all compete for the
+// same cache sets.
+
+#include <tmos/memory.h>
+#include <tmos/system.h>
+#include <tmos/spin.h>
+#include <tmos/klog.h>
+#include <tmos/ds/list.h>
+#include <stdbool.h>
+
+// Index denoting the end of the free list
+#define SLAB_FREE_END UINT16_MAX
+
+// Minimum number of objects we want in a slab
+#define SLAB_MIN_OBJS 4
+
+// Header of a slab
+struct kmem_slab {
+	struct list list;         // In one of the cache's slab lists
+	struct kmem_cache *cache; // Cache this slab belongs to
+	void *objs;               // Start of objects
+	uint32_t inuse;           // Number of allocated objects
+	uint16_t free;            // Index of first free object
+	uint16_t next[];          // Index of next free object, for each free object
+};
+
+// A cache of objects
+struct kmem_cache {
+	const char *name;
+	size_t objsz;              // Size of objects, rounded up to alignment
+	size_t align;              // Alignment of objects
+	size_t hdrsz;              // Size of slab header, rounded up to alignment
+	uint32_t per_slab;         // Number of objects in a slab
+	size_t colour_max;         // Maximum colour offset
+	size_t colour_next;        // Colour offset for the next slab
+	void (*ctor) (void*);      // Optional constructor
+	struct list partial;       // Slabs with some free objects
+	struct list full;          // Slabs with no free objects
+	struct list empty;         // Slabs with no allocated objects
+	struct kmem_stats stats;
+	spin_t lock;
+};
+
+// Get slab containing the given object
+static inline struct kmem_slab* _slab_of(const void *obj) {
+	return (struct kmem_slab*) PAGE_ALGN_DOWN((vaddr_t) obj);
+}
+
+// Get slab from list pointer
+static inline struct kmem_slab* _slab_from_list(struct list *list) {
+	return container_of(list, struct kmem_slab, list);
+}
+
+// Allocate and set up a new slab for the cache. Must be called with the lock held
+static struct kmem_slab* _slab_new(struct kmem_cache *cache) {
+	struct kmem_slab *slab;
+	uint32_t i;
+	slab = kmalloc_pages(1);
+	slab->cache = cache;
+	slab->inuse = 0;
+	slab->objs = (void*) slab + cache->hdrsz + cache->colour_next;
+	// Move to the next colour
+	cache->colour_next += CACHE_LINE_SIZE > cache->align ? CACHE_LINE_SIZE : cache->align;
+	if (cache->colour_next > cache->colour_max) {
+		cache->colour_next = 0;
+	}
+	// Set up free list and construct objects
+	for (i = 0; i < cache->per_slab; i++) {
+		slab->next[i] = i + 1;
+		if (cache->ctor) {
+			cache->ctor(slab->objs + i * cache->objsz);
+		}
+	}
+	slab->next[cache->per_slab - 1] = SLAB_FREE_END;
+	slab->free = 0;
+	cache->stats.slabs++;
+	return slab;
+}
+
+// Create a cache for objects of the given size and alignment
+struct kmem_cache* kmem_cache_create(const char *name, size_t size, size_t align,
+                                     void (*ctor) (void*)) {
+	struct kmem_cache *cache;
+	size_t hdrsz = 0, left;
+	ASSERT(size);
+	if (!align) {
+		align = WORD_SIZE >> 3;
+	}
+	ASSERT(!(align & (align - 1)));
+	ASSERT(align < PAGE_SIZE);
+	cache = kcalloc(1, sizeof(struct kmem_cache));
+	cache->name = name;
+	cache->align = align;
+	cache->objsz = ROUND_UP(size, align);
+	cache->ctor = ctor;
+	// Find how many objects fit in a slab along with the header and free list
+	cache->per_slab = (PAGE_SIZE - sizeof(struct kmem_slab)) / (cache->objsz + sizeof(uint16_t));
+	while (cache->per_slab) {
+		hdrsz = ROUND_UP(sizeof(struct kmem_slab) + cache->per_slab * sizeof(uint16_t), align);
+		if (hdrsz + cache->per_slab * cache->objsz <= PAGE_SIZE) {
+			break;
+		}
+		cache->per_slab--;
+	}
+	if (cache->per_slab < SLAB_MIN_OBJS) {
+		PANIC("Object size %llu too large for cache %s\n", size, name);
+	}
+	cache->hdrsz = hdrsz;
+	left = PAGE_SIZE - hdrsz - cache->per_slab * cache->objsz;
+	cache->colour_max = ROUND_DOWN(left, align);
+	cache->colour_next = 0;
+	cache->stats.objsz = cache->objsz;
+	cache->stats.per_slab = cache->per_slab;
+	list_init(&cache->partial);
+	list_init(&cache->full);
+	list_init(&cache->empty);
+	cache->lock = SPIN_UNLOCKED;
+	return cache;
+}
+
+// Destroy a cache. All objects must have been freed
+void kmem_cache_destroy(struct kmem_cache *cache) {
+	struct kmem_slab *slab;
+	ASSERT(cache);
+	if (!list_is_empty(&cache->partial) || !list_is_empty(&cache->full)) {
+		PANIC("Cache %s destroyed with allocated objects\n", cache->name);
+	}
+	while (!list_is_empty(&cache->empty)) {
+		slab = _slab_from_list(cache->empty.next);
+		list_del(&slab->list);
+		kfree_pages(slab);
+	}
+	kfree(cache);
+}
+
+// Allocate an object from a cache
+void* kmem_cache_alloc(struct kmem_cache *cache) {
+	struct kmem_slab *slab;
+	void *obj;
+	ASSERT(cache);
+	spin_lock_intsafe(&cache->lock);
+	// Prefer partially used slabs, so that empty ones can be given back
+	if (!list_is_empty(&cache->partial)) {
+		slab = _slab_from_list(cache->partial.next);
+	} else {
+		if (!list_is_empty(&cache->empty)) {
+			slab = _slab_from_list(cache->empty.next);
+			list_del(&slab->list);
+		} else {
+			slab = _slab_new(cache);
+		}
+		list_add_front(&cache->partial, &slab->list);
+	}
+	// Pop the first free object
+	obj = slab->objs + slab->free * cache->objsz;
+	slab->free = slab->next[slab->free];
+	slab->inuse++;
+	if (slab->free == SLAB_FREE_END) {
+		list_del(&slab->list);
+		list_add_front(&cache->full, &slab->list);
+	}
+	cache->stats.allocs++;
+	cache->stats.active++;
+	spin_unlock(&cache->lock);
+	return obj;
+}
+
+// Free an object to the cache it was allocated from
+void kmem_cache_free(struct kmem_cache *cache, void *obj) {
+	struct kmem_slab *slab;
+	uint16_t idx;
+	bool was_full;
+	ASSERT(cache && obj);
+	slab = _slab_of(obj);
+	if (slab->cache != cache) {
+		PANIC("Object %#llx freed to wrong cache %s\n", obj, cache->name);
+	}
+	idx = (obj - slab->objs) / cache->objsz;
+	ASSERT(slab->objs + idx * cache->objsz == obj);
+	spin_lock_intsafe(&cache->lock);
+	was_full = slab->free == SLAB_FREE_END;
+	slab->next[idx] = slab->free;
+	slab->free = idx;
+	slab->inuse--;
+	if (!slab->inuse) {
+		// Keep at most one empty slab around. Give back the rest
+		list_del(&slab->list);
+		if (list_is_empty(&cache->empty)) {
+			list_add_front(&cache->empty, &slab->list);
+		} else {
+			kfree_pages(slab);
+			cache->stats.slabs--;
+		}
+	} else if (was_full) {
+		list_del(&slab->list);
+		list_add_front(&cache->partial, &slab->list);
+	}
+	cache->stats.frees++;
+	cache->stats.active--;
+	spin_unlock(&cache->lock);
+}
+
+// Get statistics for a cache
+void kmem_cache_stats(struct kmem_cache *cache, struct kmem_stats *stats) {
+	ASSERT(cache && stats);
+	spin_lock_intsafe(&cache->lock);
+	*stats = cache->stats;
+	spin_unlock(&cache->lock);
+}
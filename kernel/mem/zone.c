@@ -0,0 +1,117 @@
+// (C) 2018 Srimanta Barua
+//
+// Physical memory zones
+//
+// Physical memory is divided into zones by the devices which can address it: ZONE_DMA below 16M,
+// ZONE_DMA32 below 4G, and ZONE_NORMAL for the rest. Zones are built from the parsed memory map,
+// and allocations from a zone are made with the special allocation functions of the physical
+// memory manager, limited to the range of the zone. If a zone is exhausted, we fall back to the
+// zones below it, but never above it. So normal allocations only eat into low memory when there is
+// nothing else left.
+
+#include <tmos/memory.h>
+#include <tmos/system.h>
+#include <tmos/klog.h>
+
+// Names of zones, for printing
+static const char *_zone_names[NUM_ZONES] = { "DMA", "DMA32", "NORMAL" };
+
+// Zones, and the memory manager we allocate from
+static struct zone_info _zones[NUM_ZONES];
+static struct pmmgr *_pmmgr = NULL;
+
+// Set up zones from the memory map, allocating from the given physical memory manager
+void zone_init(const struct mmap *map, struct pmmgr *pmmgr) {
+	paddr_t start, end, top, lim[NUM_ZONES + 1] = { 0, ZONE_DMA_END, ZONE_DMA32_END, 0 };
+	uint32_t i, z;
+	ASSERT(map && pmmgr);
+	if (!pmmgr->spl_alloc || !pmmgr->spl_free) {
+		PANIC("Physical memory manager does not support special allocations");
+	}
+	_pmmgr = pmmgr;
+	// ZONE_NORMAL ends where available memory ends
+	top = mmap_get_avail_end(map);
+	lim[NUM_ZONES] = top > ZONE_DMA32_END ? top : ZONE_DMA32_END;
+	for (z = 0; z < NUM_ZONES; z++) {
+		_zones[z].start = lim[z];
+		_zones[z].end = lim[z + 1] < top ? lim[z + 1] : top;
+		_zones[z].size = 0;
+		if (_zones[z].end < _zones[z].start) {
+			_zones[z].end = _zones[z].start;
+		}
+	}
+	// Count frames of available memory in each zone. Which of them are free is only known to the
+	// memory manager
+	for (i = 1; i < MMAP_MAX_NUM_ENTRIES; i++) {
+		if (REGION_TYPE(map->r[i]) == REGION_TYPE_AVAIL) {
+			for (z = 0; z < NUM_ZONES; z++) {
+				start = REGION_START(map->r[i]);
+				end = REGION_START(map->r[i - 1]);
+				start = start > _zones[z].start ? start : _zones[z].start;
+				end = end < _zones[z].end ? end : _zones[z].end;
+				if (start < end) {
+					_zones[z].size += (end - start) >> PAGE_SIZE_SHIFT;
+				}
+			}
+		}
+		if (!REGION_START(map->r[i])) {
+			break;
+		}
+	}
+}
+
+// Allocate num contiguous frames, aligned to (1 << align) frames, from the given zone. Fall back to
+// lower zones if it is exhausted
+paddr_t zone_alloc(uint32_t zone, uint32_t align, uint32_t num) {
+	paddr_t ret;
+	ASSERT(_pmmgr);
+	ASSERT(zone < NUM_ZONES);
+	do {
+		// Skip zones which could never hold the allocation
+		if (_zones[zone].size < num) {
+			continue;
+		}
+		ret = _pmmgr->spl_alloc(_zones[zone].start, _zones[zone].end, align, num);
+		if (ret != PADDR_INVALID) {
+			return ret;
+		}
+	} while (zone-- > 0);
+	return PADDR_INVALID;
+}
+
+// Free num contiguous frames allocated with zone_alloc
+void zone_free(paddr_t addr, uint32_t num) {
+	ASSERT(_pmmgr);
+	_pmmgr->spl_free(addr, num);
+}
+
+// Get the zone a physical address lies in
+uint32_t zone_of(paddr_t addr) {
+	if (addr < ZONE_DMA_END) {
+		return ZONE_DMA;
+	}
+	if (addr < ZONE_DMA32_END) {
+		return ZONE_DMA32;
+	}
+	return ZONE_NORMAL;
+}
+
+// Get information about a zone. Returns false if there is no such zone
+bool zone_get_info(uint32_t zone, struct zone_info *info) {
+	ASSERT(info);
+	if (zone >= NUM_ZONES) {
+		return false;
+	}
+	*info = _zones[zone];
+	return true;
+}
+
+// Print the zones
+void zone_print() {
+	uint32_t z;
+	klog("ZONES:\n");
+	for (z = 0; z < NUM_ZONES; z++) {
+		klog("  %-6s: %#16llx - %#16llx | %llu frames\n", _zone_names[z],
+		     _zones[z].start, _zones[z].end, _zones[z].size);
+	}
+}